@@ -0,0 +1,407 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+/*
+ * The ambient light sensor source: an IIO light sensor streamed through its
+ * buffer (so the kernel pushes readings as its trigger fires, instead of us
+ * polling in_illuminance_input), or a file or fifo of lux readings for
+ * testing without one. Readings go to illum_als_sample().
+ */
+
+/* O_CLOEXEC */
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "attr.h"
+#include "illum.h"
+
+/* ccan */
+#include <ccan/pr_log/pr_log.h>
+#include <ccan/str/str.h>
+#include <ccan/array_size/array_size.h>
+#include <ccan/container_of/container_of.h>
+
+#define IIO_DEVICES "/sys/bus/iio/devices"
+
+struct als_src {
+	struct illum *illum;
+	ev_io w;
+	const char *path;
+
+	/*
+	 * IIO: our channel is the only one enabled, so every scan is one
+	 * sample of bytes bytes. See als_iio_decode().
+	 */
+	bool iio;
+	unsigned bytes;
+	unsigned bits;
+	unsigned shift;
+	bool be;
+	bool sign;
+	double scale;
+	double offset;
+
+	/* partial scan or line left over from the last read */
+	size_t len;
+	char buf[512];
+};
+
+/* channels we know how to turn into lux, in order of preference */
+static const char *const iio_channels[] = {
+	"in_illuminance",
+	"in_illuminance0",
+};
+
+static int
+iio_write(int dir_fd, const char *attr, const char *val)
+{
+	int fd = attr_open(dir_fd, attr, O_WRONLY);
+	if (fd < 0)
+		return fd;
+
+	ssize_t r = write(fd, val, strlen(val));
+	close(fd);
+	return r < 0 ? -3 : 0;
+}
+
+static double
+iio_read_double(int dir_fd, const char *attr, double def)
+{
+	char buf[64], *end;
+	if (attr_read_str_at(dir_fd, attr, buf, sizeof(buf)) <= 0)
+		return def;
+
+	double v = strtod(buf, &end);
+	return end == buf ? def : v;
+}
+
+/*
+ * Leave only @ch enabled, so the scan layout is just it. The buffer is
+ * exclusive anyway (iio-sensor-proxy & co can't share it with us).
+ */
+static int
+iio_scan_only(int dir_fd, const char *ch)
+{
+	int fd = openat(dir_fd, "scan_elements", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	DIR *d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return -errno;
+	}
+
+	struct dirent *de;
+	size_t ch_len = strlen(ch);
+	char path[NAME_MAX + 32];
+	while ((de = readdir(d))) {
+		if (!strends(de->d_name, "_en"))
+			continue;
+		bool ours = strlen(de->d_name) == ch_len + 3 &&
+			strstarts(de->d_name, ch);
+		snprintf(path, sizeof(path), "scan_elements/%s", de->d_name);
+		if (iio_write(dir_fd, path, ours ? "1" : "0") && ours) {
+			closedir(d);
+			return -EIO;
+		}
+	}
+
+	closedir(d);
+	return 0;
+}
+
+/*
+ * The device's own trigger, which drivers name "<name>-dev<N>" for
+ * iio:device<N>. Anything else (hrtimer triggers and such) is for the user
+ * to set up in trigger/current_trigger.
+ */
+static int
+iio_trigger_find(const char *dev, char *trig, size_t sz)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-dev%s", dev + strcspn(dev, "0123456789"));
+
+	DIR *d = opendir(IIO_DEVICES);
+	if (!d)
+		return -errno;
+
+	struct dirent *de;
+	int r = -ENOENT;
+	while ((de = readdir(d))) {
+		char path[NAME_MAX + 32];
+		if (!strstarts(de->d_name, "trigger"))
+			continue;
+
+		snprintf(path, sizeof(path), IIO_DEVICES "/%s/name", de->d_name);
+		if (attr_read_str_at(AT_FDCWD, path, trig, sz) > 0 &&
+				strends(trig, suffix)) {
+			r = 0;
+			break;
+		}
+	}
+
+	closedir(d);
+	return r;
+}
+
+static uint64_t
+als_iio_raw(const struct als_src *as, const unsigned char *p)
+{
+	uint64_t v = 0;
+	unsigned i;
+	for (i = 0; i < as->bytes; i++)
+		v = v << 8 | p[as->be ? i : as->bytes - 1 - i];
+	return v;
+}
+
+/* a scan to lux, as laid out by scan_elements/<channel>_type */
+static double
+als_iio_decode(const struct als_src *as, const unsigned char *p)
+{
+	uint64_t v = als_iio_raw(as, p) >> as->shift;
+	if (as->bits < 64) {
+		uint64_t mask = (UINT64_C(1) << as->bits) - 1;
+		v &= mask;
+		if (as->sign && v >> (as->bits - 1))
+			v |= ~mask;
+	}
+
+	double raw = as->sign ? (double)(int64_t)v : (double)v;
+	return (raw + as->offset) * as->scale;
+}
+
+static void
+als_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct als_src *as = container_of(w, struct als_src, w);
+	wake_note(EV_A_ WAKE_ALS);
+	double sum = 0;
+	unsigned n = 0;
+	bool gone = false;
+
+	for (;;) {
+		ssize_t r = read(w->fd, as->buf + as->len, sizeof(as->buf) - 1 - as->len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && errno == EAGAIN)
+			break;
+		if (r <= 0) {
+			if (r)
+				pr_warn("als: %s: %s, no more readings\n", as->path, strerror(errno));
+			else
+				pr_info("als: %s ended, no more readings\n", as->path);
+			gone = true;
+			break;
+		}
+
+		as->len += r;
+		char *p = as->buf;
+		if (as->iio) {
+			for (; (size_t)(as->buf + as->len - p) >= as->bytes; p += as->bytes) {
+				sum += als_iio_decode(as, (unsigned char *)p);
+				n++;
+			}
+		} else {
+			char *nl, *end;
+			as->buf[as->len] = '\0';
+			while ((nl = strchr(p, '\n'))) {
+				double lux = strtod(p, &end);
+				if (end != p) {
+					sum += lux;
+					n++;
+				}
+				p = nl + 1;
+			}
+		}
+
+		as->len -= p - as->buf;
+		memmove(as->buf, p, as->len);
+		if (as->len == sizeof(as->buf) - 1)
+			as->len = 0;
+	}
+
+	/* one sample per wakeup, see illum_als_sample() */
+	if (n)
+		illum_als_sample(as->illum, sum / n EV_A__);
+
+	if (gone) {
+		illum_als_stop(as->illum EV_A__);
+		ev_io_stop(EV_A_ w);
+		close(w->fd);
+		free(as);
+	}
+}
+
+/*
+ * Configure the buffer of the IIO device at @dir (channel, scan layout,
+ * trigger) and open its character device.
+ */
+static int
+als_iio_open(struct als_src *as, const char *dir)
+{
+	int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) {
+		pr_error("als: %s: %s\n", dir, strerror(errno));
+		return -errno;
+	}
+
+	int r;
+	const char *dev = strrchr(dir, '/');
+	dev = dev ? dev + 1 : dir;
+	char attr[64], buf[64] = "";
+
+	/* the layout can't be changed while it runs */
+	iio_write(dir_fd, "buffer/enable", "0");
+
+	size_t i;
+	const char *ch = NULL;
+	for (i = 0; i < ARRAY_SIZE(iio_channels) && !ch; i++) {
+		snprintf(attr, sizeof(attr), "scan_elements/%s_en", iio_channels[i]);
+		if (!faccessat(dir_fd, attr, W_OK, 0))
+			ch = iio_channels[i];
+	}
+	if (!ch) {
+		pr_error("als: %s has no illuminance channel that can be buffered\n", dir);
+		r = -ENOENT;
+		goto out;
+	}
+
+	r = iio_scan_only(dir_fd, ch);
+	if (r < 0) {
+		pr_error("als: %s: could not enable %s: %s\n", dir, ch, strerror(-r));
+		goto out;
+	}
+
+	/* like "le:u32/32>>0" */
+	char endian[3], sign;
+	unsigned storage;
+	snprintf(attr, sizeof(attr), "scan_elements/%s_type", ch);
+	if (attr_read_str_at(dir_fd, attr, buf, sizeof(buf)) <= 0 ||
+			sscanf(buf, "%2[bel]:%c%u/%u>>%u", endian, &sign, &as->bits,
+				&storage, &as->shift) != 5 ||
+			!as->bits || as->bits > 64 || storage % 8 || !storage ||
+			storage > 64) {
+		pr_error("als: %s: can't handle %s_type '%s'\n", dir, ch, buf);
+		r = -EINVAL;
+		goto out;
+	}
+	as->bytes = storage / 8;
+	as->be = streq(endian, "be");
+	as->sign = sign == 's';
+
+	/* in_illuminance0 may share in_illuminance_scale with its siblings */
+	snprintf(attr, sizeof(attr), "%s_scale", ch);
+	as->scale = iio_read_double(dir_fd, attr,
+			iio_read_double(dir_fd, "in_illuminance_scale", 1));
+	snprintf(attr, sizeof(attr), "%s_offset", ch);
+	as->offset = iio_read_double(dir_fd, attr,
+			iio_read_double(dir_fd, "in_illuminance_offset", 0));
+
+	/* devices that buffer in hardware have no trigger to set */
+	if (attr_read_str_at(dir_fd, "trigger/current_trigger", buf, sizeof(buf)) == 0) {
+		r = iio_trigger_find(dev, buf, sizeof(buf));
+		if (!r)
+			r = iio_write(dir_fd, "trigger/current_trigger", buf);
+		if (r) {
+			pr_error("als: %s has no trigger, set one in trigger/current_trigger\n", dir);
+			r = -ENOENT;
+			goto out;
+		}
+		pr_debug("als: %s: using trigger %s\n", dir, buf);
+	}
+
+	/* room for a few scans, each one wakes us (the default watermark) */
+	iio_write(dir_fd, "buffer/length", "16");
+	if (iio_write(dir_fd, "buffer/enable", "1")) {
+		pr_error("als: %s: could not enable the buffer\n", dir);
+		r = -EIO;
+		goto out;
+	}
+
+	char node[PATH_MAX];
+	snprintf(node, sizeof(node), "/dev/%s", dev);
+	r = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (r == -1) {
+		pr_error("als: %s: %s\n", node, strerror(errno));
+		r = -errno;
+		goto out;
+	}
+
+	as->iio = true;
+	pr_info("als: streaming %s of %s, scale %g\n", ch, dir, as->scale);
+
+out:
+	close(dir_fd);
+	return r;
+}
+
+/*
+ * A fifo is opened for writing as well (which Linux allows for fifos), so
+ * readings can come from one writer after another without us seeing EOF in
+ * between.
+ */
+static int
+als_file_open(const char *path)
+{
+	struct stat st;
+	bool fifo = !stat(path, &st) && S_ISFIFO(st.st_mode);
+	int fd = open(path, (fifo ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		pr_error("als: %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	return fd;
+}
+
+int illum_als_start(struct illum *illum, const char *path EV_P__)
+{
+	struct als_src *as = calloc(1, sizeof(*as));
+	if (!as) {
+		pr_error("out of memory\n");
+		return -ENOMEM;
+	}
+	as->illum = illum;
+	as->path = path;
+
+	char dir[PATH_MAX];
+	struct stat st;
+	if (strstarts(path, "iio:device"))
+		snprintf(dir, sizeof(dir), IIO_DEVICES "/%s", path);
+	else
+		snprintf(dir, sizeof(dir), "%s", path);
+
+	int fd;
+	if (!stat(dir, &st) && S_ISDIR(st.st_mode)) {
+		/* trailing slashes would hide the device's name */
+		size_t len = strlen(dir);
+		while (len > 1 && dir[len - 1] == '/')
+			dir[--len] = '\0';
+		fd = als_iio_open(as, dir);
+	} else {
+		fd = als_file_open(path);
+	}
+
+	if (fd < 0) {
+		free(as);
+		return fd;
+	}
+
+	illum->als.on = true;
+	ev_io_init(&as->w, als_cb, fd, EV_READ);
+	ev_io_start(EV_A_ &as->w);
+	return 0;
+}
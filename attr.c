@@ -0,0 +1,126 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#include "attr.h"
+
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+size_t attr_fmt_int(char *buf, intmax_t v)
+{
+	char tmp[ATTR_INT_BUF_SZ];
+	size_t l = 0, i = 0;
+	bool neg = v < 0;
+	/* avoid negating INTMAX_MIN */
+	uintmax_t u = neg ? -(uintmax_t)v : (uintmax_t)v;
+
+	do {
+		tmp[l++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+
+	if (neg)
+		buf[i++] = '-';
+	while (l)
+		buf[i++] = tmp[--l];
+
+	return i;
+}
+
+int attr_parse_int(const char *buf, size_t len, intmax_t *res)
+{
+	size_t i = 0;
+	bool neg = false;
+
+	if (i < len && buf[i] == '-') {
+		neg = true;
+		i++;
+	}
+
+	if (i == len)
+		return -4;
+
+	uintmax_t lim = neg ? -(uintmax_t)INTMAX_MIN : (uintmax_t)INTMAX_MAX;
+	uintmax_t v = 0;
+	size_t digits = 0;
+	for (; i < len; i++) {
+		unsigned d = (unsigned char)buf[i] - '0';
+		if (d > 9)
+			break;
+		if (v > (lim - d) / 10)
+			return -4;
+		v = v * 10 + d;
+		digits++;
+	}
+
+	if (!digits)
+		return -4;
+
+	for (; i < len; i++) {
+		char c = buf[i];
+		if (c != '\n' && c != ' ' && c != '\t' && c != '\0')
+			return -4;
+	}
+
+	*res = neg ? -(intmax_t)(v - 1) - 1 : (intmax_t)v;
+	return 0;
+}
+
+int attr_open(int at_fd, const char *path, int flags)
+{
+	return openat(at_fd, path, flags | O_CLOEXEC);
+}
+
+intmax_t attr_read_int(int fd)
+{
+	char buf[ATTR_INT_BUF_SZ];
+	ssize_t r = pread(fd, buf, sizeof(buf), 0);
+	if (r == -1)
+		return -3;
+
+	intmax_t res;
+	if (attr_parse_int(buf, r, &res))
+		return -4;
+
+	return res;
+}
+
+int attr_write_int(int fd, intmax_t v)
+{
+	char buf[ATTR_INT_BUF_SZ];
+	size_t l = attr_fmt_int(buf, v);
+
+	ssize_t r = pwrite(fd, buf, l, 0);
+	if (r == -1)
+		return -3;
+
+	return 0;
+}
+
+intmax_t attr_read_int_at(int at_fd, const char *path)
+{
+	int fd = attr_open(at_fd, path, O_RDONLY);
+	if (fd == -1)
+		return -2;
+
+	intmax_t r = attr_read_int(fd);
+	close(fd);
+	return r;
+}
+
+int attr_read_str_at(int at_fd, const char *path, char *buf, size_t sz)
+{
+	int fd = attr_open(at_fd, path, O_RDONLY);
+	if (fd == -1)
+		return -2;
+
+	ssize_t r = read(fd, buf, sz - 1);
+	close(fd);
+	if (r == -1)
+		return -3;
+
+	while (r && (buf[r - 1] == '\n' || buf[r - 1] == ' '))
+		r--;
+	buf[r] = '\0';
+	return r;
+}
@@ -0,0 +1,53 @@
+#ifndef ILLUM_ATTR_H_
+#define ILLUM_ATTR_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * sysfs attribute access for attributes that hold a single integer.
+ *
+ * Attributes that are touched repeatedly (brightness) are kept open for the
+ * lifetime of their owner and accessed with pread()/pwrite() at offset 0,
+ * which makes kernfs re-run the show()/store() for each access. That keeps a
+ * read or a write to a single syscall, with no path lookup.
+ *
+ * Errors are returned as negative values:
+ *  -2: open failed
+ *  -3: read/write failed
+ *  -4: contents could not be parsed
+ */
+
+/* enough for INTMAX_MIN in decimal, plus a newline & nul */
+#define ATTR_INT_BUF_SZ 22
+
+/*
+ * Format @v as decimal into @buf (which must have at least ATTR_INT_BUF_SZ
+ * bytes). Returns the number of characters written. No nul is appended.
+ */
+size_t attr_fmt_int(char *buf, intmax_t v);
+
+/*
+ * Parse a decimal integer from @buf, ignoring trailing whitespace (sysfs
+ * terminates values with a newline). Returns 0 on success or -4.
+ */
+int attr_parse_int(const char *buf, size_t len, intmax_t *res);
+
+/* open an attribute relative to a sysfs directory */
+int attr_open(int at_fd, const char *path, int flags);
+
+intmax_t attr_read_int(int fd);
+int attr_write_int(int fd, intmax_t v);
+
+/* one shot read for attributes that are only read once */
+intmax_t attr_read_int_at(int at_fd, const char *path);
+
+/*
+ * One shot read of a text attribute (like a backlight's type) into @buf,
+ * without the trailing newline and always nul terminated. Returns the length
+ * or -2/-3.
+ */
+int attr_read_str_at(int at_fd, const char *path, char *buf, size_t sz);
+
+#endif
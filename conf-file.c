@@ -0,0 +1,203 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+/* O_CLOEXEC, getline() */
+#define _GNU_SOURCE
+
+#include "conf-file.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+/* ccan */
+#include <ccan/pr_log/pr_log.h>
+#include <ccan/str/str.h>
+#include <ccan/container_of/container_of.h>
+
+/* how long the file has to be left alone before it is read */
+#define CONF_SETTLE 0.1
+
+void conf_file_init(struct conf_file *cf)
+{
+	*cf = (struct conf_file) { 0 };
+}
+
+int conf_file_arg(struct conf_file *cf, int c, const char *arg)
+{
+	struct conf_arg *a = realloc(cf->args, (cf->arg_ct + 1) * sizeof(*a));
+	if (!a)
+		return -ENOMEM;
+
+	cf->args = a;
+	cf->args[cf->arg_ct++] = (struct conf_arg) { c, arg };
+	return 0;
+}
+
+/* one line of the file, 0 if it was applied (or is empty) */
+static int
+conf_file_line(struct conf_file *cf, struct illum_conf *conf, char *line,
+		unsigned n)
+{
+	char *p = line + strspn(line, " \t");
+	size_t len = strlen(p);
+	while (len && isspace((unsigned char)p[len - 1]))
+		p[--len] = '\0';
+
+	if (!*p || *p == '#')
+		return 0;
+
+	if (p[0] != '-' || !p[1] || (p[2] && !isspace((unsigned char)p[2]))) {
+		fprintf(stderr, "E: %s:%u: expected an option like '-c cie', got '%s'\n",
+				cf->path, n, p);
+		return -1;
+	}
+
+	int c = p[1];
+	char *arg = p + 2 + strspn(p + 2, " \t");
+	const char *o = c == ':' ? NULL : strchr(ILLUM_CONF_OPTS, c);
+	if (!o) {
+		fprintf(stderr, "E: %s:%u: -%c can't be set in a config file\n",
+				cf->path, n, c);
+		return -1;
+	}
+
+	if (o[1] == ':' && !*arg) {
+		fprintf(stderr, "E: %s:%u: -%c needs an argument\n", cf->path, n, c);
+		return -1;
+	}
+
+	if (illum_conf_opt(conf, c, arg)) {
+		fprintf(stderr, "E: %s:%u: bad -%c\n", cf->path, n, c);
+		return -1;
+	}
+
+	return 0;
+}
+
+int conf_file_load(struct conf_file *cf, struct illum_conf *conf)
+{
+	FILE *f = fopen(cf->path, "re");
+	if (!f) {
+		int e = errno;
+		fprintf(stderr, "E: %s: %s\n", cf->path, strerror(e));
+		return -e;
+	}
+
+	int r = illum_conf_init(conf);
+	if (r < 0) {
+		fprintf(stderr, "E: out of memory\n");
+		fclose(f);
+		return r;
+	}
+
+	char *line = NULL;
+	size_t sz = 0;
+	unsigned n = 0;
+	while (!r && getline(&line, &sz, f) != -1)
+		r = conf_file_line(cf, conf, line, ++n);
+	free(line);
+	fclose(f);
+
+	size_t i;
+	for (i = 0; !r && i < cf->arg_ct; i++)
+		if (illum_conf_opt(conf, cf->args[i].c, cf->args[i].arg))
+			r = -1;
+
+	if (r) {
+		illum_conf_free(conf);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void
+conf_file_settle_cb(EV_P_ ev_timer *w, int revents)
+{
+	(void)revents;
+
+	struct conf_file *cf = container_of(w, struct conf_file, w_settle);
+	struct illum_conf conf;
+	wake_note(EV_A_ WAKE_CONF);
+
+	ev_timer_stop(EV_A_ w);
+	if (conf_file_load(cf, &conf)) {
+		pr_warn("conf: %s not reloaded, keeping the current configuration\n",
+				cf->path);
+		return;
+	}
+
+	cf->reloads++;
+	pr_info("conf: reloading %s (#%ju)\n", cf->path, cf->reloads);
+	illum_reconf(cf->illum, &conf EV_A__);
+}
+
+/*
+ * Only notes that the file changed: the reload waits for CONF_SETTLE
+ * without further changes, so an editor's write, rename and chmod cost one
+ * reload.
+ */
+static void
+conf_file_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct conf_file *cf = container_of(w, struct conf_file, w);
+	wake_note(EV_A_ WAKE_CONF);
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+
+	for (;;) {
+		ssize_t r = read(w->fd, buf, sizeof(buf));
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+
+		char *p;
+		for (p = buf; p < buf + r; ) {
+			const struct inotify_event *ie = (const struct inotify_event *)p;
+			if (ie->mask & IN_Q_OVERFLOW ||
+					(ie->len && streq(ie->name, cf->name)))
+				changed = true;
+			p += sizeof(*ie) + ie->len;
+		}
+	}
+
+	if (changed)
+		ev_timer_again(EV_A_ &cf->w_settle);
+}
+
+int conf_file_watch(struct conf_file *cf, struct illum *illum EV_P__)
+{
+	char dir[PATH_MAX];
+	const char *slash = strrchr(cf->path, '/');
+	if (slash == cf->path)
+		snprintf(dir, sizeof(dir), "/");
+	else if (slash)
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - cf->path), cf->path);
+	else
+		snprintf(dir, sizeof(dir), ".");
+	cf->name = slash ? slash + 1 : cf->path;
+	cf->illum = illum;
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1)
+		return -errno;
+
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB) == -1) {
+		int e = errno;
+		close(fd);
+		return -e;
+	}
+
+	ev_init(&cf->w_settle, conf_file_settle_cb);
+	cf->w_settle.repeat = CONF_SETTLE;
+	ev_io_init(&cf->w, conf_file_cb, fd, EV_READ);
+	ev_io_start(EV_A_ &cf->w);
+	return 0;
+}
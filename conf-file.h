@@ -0,0 +1,57 @@
+#ifndef ILLUM_CONF_FILE_H_
+#define ILLUM_CONF_FILE_H_
+#pragma once
+
+#include "illum.h"
+
+/*
+ * The config file (-C): the options of ILLUM_CONF_OPTS, one per line, written
+ * as on the command line:
+ *
+ *	# comments and blank lines are skipped
+ *	-c cie
+ *	-k shift+KEY_BRIGHTNESSUP=up:1
+ *
+ * Options given on the command line are applied after the file's, so they
+ * win. The file's directory is watched with inotify (editors tend to replace
+ * files rather than write them), and once it has been quiet for a moment
+ * the file is read into a fresh illum_conf and handed to illum_reconf(). A
+ * file that doesn't parse leaves the running configuration alone.
+ */
+
+struct conf_arg {
+	int c;
+	const char *arg;
+};
+
+struct conf_file {
+	const char *path;
+	const char *name;
+
+	/* from the command line, applied over the file's */
+	struct conf_arg *args;
+	size_t arg_ct;
+
+	struct illum *illum;
+	ev_io w;
+	/* events come in bursts while a file is written, see conf_file_cb() */
+	ev_timer w_settle;
+
+	uintmax_t reloads;
+};
+
+void conf_file_init(struct conf_file *cf);
+
+/* remember a command line option, returns 0 or negative if out of memory */
+int conf_file_arg(struct conf_file *cf, int c, const char *arg);
+
+/*
+ * Build @conf from the defaults, the file and the command line options.
+ * Returns 0, or negative after printing why not.
+ */
+int conf_file_load(struct conf_file *cf, struct illum_conf *conf);
+
+/* reload into @illum whenever the file changes, returns 0 or negative errno */
+int conf_file_watch(struct conf_file *cf, struct illum *illum EV_P__);
+
+#endif
@@ -0,0 +1,6 @@
+#include <sys/sdt.h>
+int main(void)
+{
+	DTRACE_PROBE(illum, config_test);
+	return 0;
+}
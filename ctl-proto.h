@@ -0,0 +1,73 @@
+#ifndef ILLUM_CTL_PROTO_H_
+#define ILLUM_CTL_PROTO_H_
+#pragma once
+
+/*
+ * illum-d control socket protocol
+ *
+ * A SOCK_STREAM unix socket carrying newline terminated text lines. Each
+ * request line gets exactly one response line, in order, so clients may
+ * pipeline as many requests as they like before reading responses.
+ *
+ * Requests (words separated by spaces, <bl> is a backlight name like
+ * "intel_backlight", or "*" for all of them, which is the default):
+ *
+ *   list                     -> ok <bl> <bl> ...
+ *   get [<bl>]               -> ok <permille>
+ *   raw [<bl>]               -> ok <raw> <max_brightness>
+ *   set [<bl>] <permille>    -> ok
+ *   step [<bl>] <+-permille> -> ok
+ *   sub [<msec>]             -> ok
+ *   unsub                    -> ok
+ *   stats                    -> ok <wakeups> <cpu-us> <src>=<wakeups>/<calls>/<cpu-us> ...
+ *
+ * Brightness is given in permille along the perceptual curve (the same
+ * scale brightness keys step along), 0 to 1000. "get" and "raw" on "*"
+ * report the first backlight.
+ *
+ * "stats" reports the daemon's wakeups and the CPU time spent handling them
+ * (see wake.h): in total, then for each source that has run, how many
+ * wakeups it caused, how many times its callbacks ran and their CPU time.
+ *
+ * Errors are reported as "err <message>".
+ *
+ * After "sub" the connection also receives unsolicited event lines
+ *
+ *   ev <bl> <permille>
+ *
+ * whenever a backlight's brightness changes (including each step of a fade,
+ * so these can differ from "get", which reports where it is heading). The
+ * current brightness of every backlight is sent right after subscribing.
+ * Events are sent at most once per <msec> (default
+ * ILLUM_CTL_SUB_INTERVAL_MS, 0 for no limit); changes in between are merged
+ * so only the latest brightness of each backlight is sent. The same goes for
+ * a client that doesn't keep up with reading them.
+ */
+
+#define ILLUM_CTL_PATH "/run/illum/ctl"
+
+/* longest request or response line, including the newline */
+#define ILLUM_CTL_LINE_MAX 256
+
+#define ILLUM_CTL_PERMILLE 1000
+
+#define ILLUM_CTL_SUB_INTERVAL_MS 50
+
+/*
+ * Inhibit socket
+ *
+ * A connection to this socket is an inhibit, which lasts until every copy
+ * of the fd is closed (so it can be handed to a child process, and goes away
+ * with whatever holds it, however it exits). Nothing is ever sent back.
+ *
+ * The connection may optionally start with a line naming what to inhibit:
+ *
+ *   dim  idle dimming (the default)
+ *   all  every brightness change illum-d makes on its own, which includes
+ *        idle dimming
+ *
+ * Anything else sent on the connection is ignored.
+ */
+#define ILLUM_INHIBIT_PATH "/run/illum/inhibit"
+
+#endif
@@ -0,0 +1,161 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+/*
+ * Checks the curves: for every curve, and for a spread of max_brightness
+ * values up to CURVE_MAX,
+ *
+ *  - every raw value survives raw -> position -> raw, so a brightness read
+ *    back from sysfs lands where it was,
+ *  - curve_raw_to_pos() is strictly increasing, and curve_pos_to_raw() never
+ *    goes down as the position goes up,
+ *  - the ends map to 0 and max,
+ *
+ * and that curve_init() refuses a max it can't round-trip.
+ *
+ * Exits 0 if all of that held, 1 after printing what didn't.
+ */
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "curve.h"
+
+static const struct curve_params curves[] = {
+	{ CURVE_POWER, 1 },
+	{ CURVE_POWER, 2 },
+	{ CURVE_POWER, 3 },
+	{ CURVE_POWER, 4 },
+	{ CURVE_POWER, 5 },
+	{ CURVE_POWER, 6 },
+	{ CURVE_EXP, 0 },
+	{ CURVE_CIE, 0 },
+};
+
+/* seen in the wild, plus the edges of the table and of CURVE_MAX */
+static const uint32_t maxes[] = {
+	CURVE_STEPS - 1, CURVE_STEPS, CURVE_STEPS + 1,
+	852, 937, 1515, 4095, 4882, 7500, 19393, 65535, 96000, 120000,
+	1000000, 4000000, CURVE_MAX - 1, CURVE_MAX,
+};
+
+/* every max up to this is checked as well */
+#define SMALL_MAX 1024
+
+/* curve_pos_to_raw() is checked at this many evenly spaced positions */
+#define POS_SAMPLES (1u << 16)
+
+static unsigned failures;
+
+static void
+fail(const struct curve_params *p, uint32_t max, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void
+fail(const struct curve_params *p, uint32_t max, const char *fmt, ...)
+{
+	va_list ap;
+	printf("FAIL %s/%u max %" PRIu32 ": ", curve_type_name(p->type),
+			p->linearity, max);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	failures++;
+}
+
+/* returns false if the curve failed, so a broken one is reported once */
+static bool
+check_curve(const struct curve_params *p, uint32_t max)
+{
+	struct curve c;
+	if (curve_init(&c, p, max)) {
+		fail(p, max, "curve_init() refused it");
+		return false;
+	}
+
+	if (curve_pos_to_raw(&c, 0) != 0 || curve_pos_to_raw(&c, CURVE_POS_ONE) != max) {
+		fail(p, max, "ends map to %" PRIu32 " and %" PRIu32,
+				curve_pos_to_raw(&c, 0),
+				curve_pos_to_raw(&c, CURVE_POS_ONE));
+		return false;
+	}
+
+	uint32_t r, prev_pos = 0;
+	for (r = 0; r <= max; r++) {
+		uint32_t pos = curve_raw_to_pos(&c, r);
+		uint32_t back = curve_pos_to_raw(&c, pos);
+		if (back != r) {
+			fail(p, max, "raw %" PRIu32 " -> pos %" PRIu32 " -> raw %" PRIu32,
+					r, pos, back);
+			return false;
+		}
+
+		if (r && pos <= prev_pos) {
+			fail(p, max, "raw %" PRIu32 " -> pos %" PRIu32 ", not above raw %"
+					PRIu32 "'s %" PRIu32, r, pos, r - 1, prev_pos);
+			return false;
+		}
+		prev_pos = pos;
+	}
+
+	uint32_t i, prev_raw = 0;
+	for (i = 0; i <= POS_SAMPLES; i++) {
+		uint32_t pos = (uint64_t)i * CURVE_POS_ONE / POS_SAMPLES;
+		uint32_t raw = curve_pos_to_raw(&c, pos);
+		if (raw < prev_raw || raw > max) {
+			fail(p, max, "pos %" PRIu32 " -> raw %" PRIu32 " after %" PRIu32,
+					pos, raw, prev_raw);
+			return false;
+		}
+		prev_raw = raw;
+	}
+
+	return true;
+}
+
+static void
+check_refused(const struct curve_params *p, uint32_t max)
+{
+	struct curve c;
+	if (!curve_init(&c, p, max))
+		fail(p, max, "curve_init() took it");
+}
+
+int main(void)
+{
+	unsigned i, j;
+	uint32_t max;
+	uintmax_t checked = 0;
+
+	for (i = 0; i < sizeof(curves) / sizeof(curves[0]); i++) {
+		const struct curve_params *p = &curves[i];
+
+		for (max = 1; max <= SMALL_MAX; max++, checked++)
+			if (!check_curve(p, max))
+				break;
+
+		for (j = 0; j < sizeof(maxes) / sizeof(maxes[0]); j++, checked++)
+			check_curve(p, maxes[j]);
+
+		check_refused(p, 0);
+		check_refused(p, CURVE_MAX + 1);
+		check_refused(p, CURVE_POS_ONE);
+		check_refused(p, UINT32_MAX);
+	}
+
+	struct curve_params bad = { CURVE_POWER, 0 };
+	check_refused(&bad, 1000);
+	bad.linearity = 7;
+	check_refused(&bad, 1000);
+
+	if (failures) {
+		printf("%u failures\n", failures);
+		return 1;
+	}
+
+	printf("ok: %ju curves round-trip, up to max %" PRIu32 "\n",
+			checked, (uint32_t)CURVE_MAX);
+	return 0;
+}
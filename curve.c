@@ -0,0 +1,137 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#include "curve.h"
+
+#include <math.h>
+#include <string.h>
+
+static const char *const curve_names[] = {
+	[CURVE_POWER] = "power",
+	[CURVE_EXP] = "exp",
+	[CURVE_CIE] = "cie",
+};
+
+#define CURVE_TYPE_CT (sizeof(curve_names) / sizeof(curve_names[0]))
+
+int curve_type_from_name(const char *name)
+{
+	unsigned i;
+	for (i = 0; i < CURVE_TYPE_CT; i++)
+		if (!strcmp(name, curve_names[i]))
+			return i;
+	return -1;
+}
+
+const char *curve_type_name(enum curve_type type)
+{
+	if (type >= CURVE_TYPE_CT)
+		return "unknown";
+	return curve_names[type];
+}
+
+/* base for CURVE_EXP, the ratio between full and (nearly) off */
+#define CURVE_EXP_BASE 100.
+
+/*
+ * CIE 1976 lightness, inverted: the relative luminance that gives a
+ * lightness of @p * 100.
+ */
+static double
+cie_lstar_inv(double p)
+{
+	double l = p * 100.;
+	if (l <= 8.)
+		return l / 903.3;
+	double t = (l + 16.) / 116.;
+	return t * t * t;
+}
+
+static double
+curve_eval(const struct curve_params *p, double x)
+{
+	switch (p->type) {
+	case CURVE_POWER:
+		return pow(x, (double)(1u << (p->linearity - 1)));
+	case CURVE_EXP:
+		return (pow(CURVE_EXP_BASE, x) - 1.) / (CURVE_EXP_BASE - 1.);
+	case CURVE_CIE:
+		return cie_lstar_inv(x);
+	}
+
+	return x;
+}
+
+int curve_init(struct curve *c, const struct curve_params *p, uint32_t max)
+{
+	if (p->type >= CURVE_TYPE_CT)
+		return -1;
+	/* past this the exponent no longer fits */
+	if (p->type == CURVE_POWER && (p->linearity < 1 || p->linearity > 6))
+		return -1;
+	if (!max || max > CURVE_MAX)
+		return -1;
+
+	c->max = max;
+
+	unsigned i;
+	for (i = 0; i <= CURVE_STEPS; i++) {
+		double y = curve_eval(p, (double)i / CURVE_STEPS) * max;
+		uint32_t v = y < 0 ? 0 : y > max ? max : lround(y);
+		/* keep the table monotonic even if rounding disagrees */
+		if (i && v < c->raw[i - 1])
+			v = c->raw[i - 1];
+		c->raw[i] = v;
+	}
+
+	c->raw[0] = 0;
+	c->raw[CURVE_STEPS] = max;
+	return 0;
+}
+
+uint32_t curve_pos_to_raw(const struct curve *c, uint32_t pos)
+{
+	if (pos >= CURVE_POS_ONE)
+		return c->max;
+
+	uint64_t x = (uint64_t)pos * CURVE_STEPS;
+	uint32_t i = x >> CURVE_POS_BITS;
+	uint64_t f = x & (CURVE_POS_ONE - 1);
+	uint64_t d = c->raw[i + 1] - c->raw[i];
+
+	return c->raw[i] + ((d * f + CURVE_POS_ONE / 2) >> CURVE_POS_BITS);
+}
+
+/*
+ * Returns the position in the middle of the range of positions that map to
+ * @raw, so that curve_pos_to_raw(curve_raw_to_pos(r)) == r for all r <= max.
+ */
+uint32_t curve_raw_to_pos(const struct curve *c, uint32_t raw)
+{
+	if (raw >= c->max)
+		return CURVE_POS_ONE;
+
+	/* last entry <= raw, in [0, CURVE_STEPS) */
+	uint32_t lo = 0, hi = CURVE_STEPS;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (c->raw[mid] <= raw)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	uint64_t d = c->raw[lo + 1] - c->raw[lo];
+	uint64_t t = raw - c->raw[lo];
+	uint64_t f = 0;
+	if (d) {
+		/* the fractions that round to t, see curve_pos_to_raw() */
+		uint64_t half = CURVE_POS_ONE / 2;
+		uint64_t n_lo = t << CURVE_POS_BITS;
+		uint64_t n_hi = (t + 1) << CURVE_POS_BITS;
+		uint64_t f_lo = n_lo > half ? (n_lo - half + d - 1) / d : 0;
+		uint64_t f_hi = (n_hi - half + d - 1) / d - 1;
+		f = (f_lo + f_hi) / 2;
+	}
+
+	uint64_t x = ((uint64_t)lo << CURVE_POS_BITS) + f;
+	return (x + CURVE_STEPS / 2) / CURVE_STEPS;
+}
@@ -0,0 +1,56 @@
+#ifndef ILLUM_CURVE_H_
+#define ILLUM_CURVE_H_
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Brightness curves map a perceptual position to a raw backlight value.
+ *
+ * Positions are fixed point, with CURVE_POS_ONE being full brightness. A
+ * curve is sampled once into a table of CURVE_STEPS + 1 raw values when a
+ * backlight is added; lookups interpolate between entries and the reverse
+ * mapping is a binary search over the same table.
+ */
+#define CURVE_POS_BITS 28
+#define CURVE_POS_ONE (UINT32_C(1) << CURVE_POS_BITS)
+#define CURVE_STEPS 256
+
+/*
+ * The largest max a curve takes. Raw values only round-trip through
+ * positions while every raw step is at least one position wide, and the
+ * steepest curve (power, linearity 6) climbs 32 raw values per position at
+ * the top, so max has to stay below CURVE_POS_ONE by that much.
+ */
+#define CURVE_MAX (CURVE_POS_ONE >> 5)
+
+/* convert a percentage (possibly negative) into position units */
+#define CURVE_POS_PERCENT(p) ((int32_t)((int64_t)(p) * CURVE_POS_ONE / 100))
+
+enum curve_type {
+	CURVE_POWER,
+	CURVE_EXP,
+	CURVE_CIE,
+};
+
+struct curve_params {
+	enum curve_type type;
+	/* CURVE_POWER: the position is squared (linearity - 1) times */
+	unsigned linearity;
+};
+
+struct curve {
+	uint32_t max;
+	uint32_t raw[CURVE_STEPS + 1];
+};
+
+int curve_type_from_name(const char *name);
+const char *curve_type_name(enum curve_type type);
+
+/* returns 0 on success, negative if @p is invalid or @max is 0 or above CURVE_MAX */
+int curve_init(struct curve *c, const struct curve_params *p, uint32_t max);
+
+uint32_t curve_pos_to_raw(const struct curve *c, uint32_t pos);
+uint32_t curve_raw_to_pos(const struct curve *c, uint32_t raw);
+
+#endif
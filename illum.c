@@ -0,0 +1,3343 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+
+/* accept4() */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+
+/* posix */
+#include <unistd.h>
+#include <errno.h> /* EAGAIN */
+
+/* opendir() */
+#include <sys/types.h>
+#include <dirent.h>
+
+/* ioctl() */
+#include <sys/ioctl.h>
+
+/* major(), minor() */
+#include <sys/sysmacros.h>
+
+/* open() */
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* control socket */
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* setrlimit() */
+#include <sys/resource.h>
+
+/* libevdev */
+#include <libevdev/libevdev.h>
+
+/* ev */
+#include "ev-ext.h"
+
+#include "config.h"
+#include "attr.h"
+#include "illum.h"
+#include "svc.h"
+
+/*
+ * Static tracepoints (USDT), for bpftrace/perf/systemtap. Without
+ * <sys/sdt.h> they compile to nothing.
+ */
+#if HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define ILLUM_PROBE2(name, a, b) DTRACE_PROBE2(illum, name, a, b)
+# define ILLUM_PROBE3(name, a, b, c) DTRACE_PROBE3(illum, name, a, b, c)
+# define ILLUM_PROBE4(name, a, b, c, d) DTRACE_PROBE4(illum, name, a, b, c, d)
+#else
+# define ILLUM_PROBE2(name, a, b) ((void)(a), (void)(b))
+# define ILLUM_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+# define ILLUM_PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+/* ccan */
+#include <ccan/pr_log/pr_log.h>
+#include <ccan/tlist2/tlist2.h>
+#include <ccan/str/str.h>
+#include <ccan/array_size/array_size.h>
+#include <ccan/htable/htable_type.h>
+
+
+const char *const lat_stage_names[LAT_STAGE_CT] = {
+	[LAT_DELIVER] = "deliver",
+	[LAT_COMPUTE] = "compute",
+	[LAT_QUEUE] = "queue",
+	[LAT_WRITE] = "write",
+	[LAT_TOTAL] = "total",
+};
+
+static const char *const bl_type_names[] = {
+	[BL_UNKNOWN] = "unknown",
+	[BL_FIRMWARE] = "firmware",
+	[BL_PLATFORM] = "platform",
+	[BL_RAW] = "raw",
+};
+
+static const char *const inhibit_names[INHIBIT_CT] = {
+	[INHIBIT_DIM] = "dim",
+	[INHIBIT_ALL] = "all",
+};
+
+
+
+/* interfaces:
+ *  cfg:
+ *   - command line for daemon startup (cfg)
+ *   - config file (cfg)
+ *     - cmdline & config file need to have the same options
+ *   - linux input devices (activity + cfg)
+ *   - x11 screensaver (inhibit + activity)
+ *    - could also be cfg/defaults if we probe for x11 configured timeouts
+ *   - unix socket (inhibit + activity + cfg)
+ *    - inhibit via: open, send inhibit cmd, (inhbit until close or unhibit
+ *      cmd)
+ *    - single socket vs multiple sockets?
+ *      - could have a socket dedicated to inhibit that discards inputs and
+ *        just inhibits while open
+ *   - dbus (inhibit + activity + cfg)
+ *     - probably has standard apis for inhibit & activity
+ */
+
+/*
+ * TODO:
+ * - locking
+ * - freezing crypto partitions
+ * - sleeping
+
+ */
+
+/*
+ * min()/max()/clamp() macros that also do
+ * strict type-checking.. See the
+ * "unnecessary" pointer comparison.
+ */
+#define min(x, y) ({				\
+	__typeof__(x) _min1 = (x);			\
+	__typeof__(y) _min2 = (y);			\
+	(void) (&_min1 == &_min2);		\
+	_min1 < _min2 ? _min1 : _min2; })
+
+#define max(x, y) ({				\
+	__typeof__(x) _max1 = (x);			\
+	__typeof__(y) _max2 = (y);			\
+	(void) (&_max1 == &_max2);		\
+	_max1 > _max2 ? _max1 : _max2; })
+
+/**
+ * clamp - return a value clamped to a given range with strict typechecking
+ * @val: current value
+ * @lo: lowest allowable value
+ * @hi: highest allowable value
+ *
+ * This macro does strict typechecking of lo/hi to make sure they are of the
+ * same type as val.  See the unnecessary pointer comparisons.
+ */
+#define clamp(val, lo, hi) min((__typeof__(val))max(val, lo), hi)
+
+/*
+ * Divide positive or negative dividend by positive divisor and round
+ * to closest integer. Result is undefined for negative divisors and
+ * for negative dividends if the divisor variable type is unsigned.
+ */
+#define DIV_ROUND_CLOSEST(x, divisor)(			\
+{							\
+	__typeof__(x) __x = x;				\
+	__typeof__(divisor) __d = divisor;			\
+	(((__typeof__(x))-1) > 0 ||				\
+	 ((__typeof__(divisor))-1) > 0 || (__x) > 0) ?	\
+		(((__x) + ((__d) / 2)) / (__d)) :	\
+		(((__x) - ((__d) / 2)) / (__d));	\
+}							\
+)
+
+static
+int opt_ulong(int c, const char *arg, unsigned long min, unsigned long max,
+		unsigned long *res)
+{
+	char *end;
+	errno = 0;
+	unsigned long x = strtoul(arg, &end, 0);
+	if (errno || end == arg || *end || *arg == '-' || x < min || x > max) {
+		fprintf(stderr, "E: -%c must be an integer between %lu and %lu, got '%s'\n",
+				c, min, max, arg);
+		return -1;
+	}
+
+	*res = x;
+	return 0;
+}
+
+/*
+ * "<backlight>" or "-<backlight>", where the backlight is a name or a
+ * directory in /sys/class/backlight.
+ */
+static
+int conf_bl_override_add(struct illum_conf *conf, const char *arg)
+{
+	bool use = *arg != '-';
+	if (!use)
+		arg++;
+
+	size_t len = strlen(arg);
+	while (len && arg[len - 1] == '/')
+		len--;
+
+	const char *name = memrchr(arg, '/', len);
+	name = name ? name + 1 : arg;
+	len -= name - arg;
+	if (!len)
+		return -1;
+
+	struct bl_override *o = realloc(conf->bl_overrides,
+			(conf->bl_override_ct + 1) * sizeof(*o));
+	if (!o)
+		return -ENOMEM;
+	conf->bl_overrides = o;
+
+	o += conf->bl_override_ct;
+	o->name = strndup(name, len);
+	if (!o->name)
+		return -ENOMEM;
+	o->use = use;
+	conf->bl_override_ct++;
+	return 0;
+}
+
+int illum_conf_opt(struct illum_conf *conf, int c, const char *arg)
+{
+	unsigned long x;
+
+	switch (c) {
+	case 'l': {
+		long l = strtol(arg, NULL, 0);
+		if (l < 1 || l > 6) {
+			fprintf(stderr, "E: -l must be between 1 and 6, got %ld\n", l);
+			return -1;
+		}
+
+		conf->curve.linearity = l;
+		return 0;
+	}
+	case 'c': {
+		int t = curve_type_from_name(arg);
+		if (t < 0) {
+			fprintf(stderr, "E: -c: unknown curve '%s'\n", arg);
+			return -1;
+		}
+
+		conf->curve.type = t;
+		return 0;
+	}
+	case 'b':
+		if (conf_bl_override_add(conf, arg)) {
+			fprintf(stderr, "E: -b: bad backlight '%s'\n", arg);
+			return -1;
+		}
+		return 0;
+	case 'f':
+	case 'F':
+		if (opt_ulong(c, arg, 0, 60000, &x))
+			return -1;
+
+		if (c == 'f')
+			conf->fade_down = x / 1000.;
+		else
+			conf->fade_up = x / 1000.;
+		return 0;
+	case 'r':
+		if (opt_ulong(c, arg, 1, 1000, &x))
+			return -1;
+
+		conf->fade_rate = x;
+		return 0;
+	case 'H':
+		if (opt_ulong(c, arg, 1, 10000, &x))
+			return -1;
+
+		conf->hold_interval = x / 1000.;
+		return 0;
+	case 't':
+		if (opt_ulong(c, arg, 0, ULONG_MAX, &x))
+			return -1;
+
+		conf->idle_timeout = x / 1000.;
+		return 0;
+	case 'd':
+		if (opt_ulong(c, arg, 0, 100, &x))
+			return -1;
+
+		conf->dim_level = CURVE_POS_PERCENT(x);
+		return 0;
+	case 'k':
+		if (keymap_bind(&conf->keymap, arg)) {
+			fprintf(stderr, "E: -k: bad binding '%s'\n", arg);
+			return -1;
+		}
+		return 0;
+	}
+
+	return 1;
+}
+
+static
+int sys_backlight_init_max_brightness(struct sys_backlight *sb)
+{
+	intmax_t r = attr_read_int_at(sb->dir_fd, "max_brightness");
+	if (r < 0)
+		return r;
+
+	/* finer than the curves' positions can tell apart, see CURVE_MAX */
+	if (!r || r > CURVE_MAX) {
+		pr_warn("%s: max_brightness %jd is out of range (1..%ju)\n",
+				sb->path, r, (uintmax_t)CURVE_MAX);
+		return -1;
+	}
+
+	sb->max_brightness = r;
+	return 0;
+}
+
+/*
+ * Actuation
+ *
+ * Some backlights (acpi_video, EC backed panels) block for tens of
+ * milliseconds in write(). So each backlight has a thread doing nothing but
+ * its writes, fed through a single slot mailbox: the event loop only stores
+ * the newest raw value there (overwriting any the worker hasn't picked up
+ * yet), so a slow backlight skips straight to the latest value and neither
+ * input handling nor the other backlights ever wait for it.
+ */
+static void *
+sys_backlight_worker(void *arg)
+{
+	struct sys_backlight *sb = arg;
+
+	pthread_mutex_lock(&sb->lock);
+	for (;;) {
+		while (!sb->mbox_full && !sb->stop)
+			pthread_cond_wait(&sb->cond, &sb->lock);
+		if (sb->stop)
+			break;
+
+		uint32_t v = sb->mbox;
+		struct lat_stamp st = sb->mbox_stamp;
+		sb->mbox_full = false;
+		sb->inflight = true;
+		pthread_mutex_unlock(&sb->lock);
+
+		uint64_t start = lat_now();
+		ILLUM_PROBE2(write_start, sb->name, v);
+		int r = attr_write_int(sb->brightness_wfd, v);
+		uint64_t end = lat_now();
+		ILLUM_PROBE4(write_end, sb->name, v, r, st.event ? end - st.event : 0);
+		if (r < 0)
+			pr_warn("failed to write %"PRIu32" to %s: %d\n", v, sb->path, r);
+
+		pthread_mutex_lock(&sb->lock);
+		sb->inflight = false;
+		sb->writes++;
+		if (r < 0)
+			sb->write_errors++;
+
+		lat_hist_add(&sb->lat[LAT_WRITE], start, end);
+		if (st.event) {
+			lat_hist_add(&sb->lat[LAT_DELIVER], st.event, st.dispatch);
+			lat_hist_add(&sb->lat[LAT_COMPUTE], st.dispatch, st.post);
+			lat_hist_add(&sb->lat[LAT_QUEUE], st.post, start);
+			lat_hist_add(&sb->lat[LAT_TOTAL], st.event, end);
+		}
+	}
+	pthread_mutex_unlock(&sb->lock);
+
+	return NULL;
+}
+
+static void
+sys_backlight_post(struct sys_backlight *sb, uint32_t v,
+		const struct lat_stamp *st)
+{
+	pthread_mutex_lock(&sb->lock);
+	/* a superseded value's input is only shown by this write */
+	if (sb->mbox_full) {
+		sb->superseded++;
+		if (!sb->mbox_stamp.event)
+			sb->mbox_stamp = *st;
+	} else {
+		sb->mbox_stamp = *st;
+	}
+	sb->mbox = v;
+	sb->mbox_full = true;
+	pthread_cond_signal(&sb->cond);
+	pthread_mutex_unlock(&sb->lock);
+}
+
+/* the level to come back to, which while dimmed or off isn't the current one */
+static void
+sys_backlight_save(struct sys_backlight *sb)
+{
+	if (sb->saved)
+		state_slot_save(sb->saved, sb->off ? sb->off_target :
+				sb->dimmed ? sb->undim_target : sb->target);
+}
+
+/*
+ * Re-read the brightness from sysfs and, if something other than us changed
+ * it, move our target to match.
+ */
+static
+int sys_backlight_brightness_sync(struct sys_backlight *sb)
+{
+	/*
+	 * While one of our writes is queued or in progress sysfs still has an
+	 * older value, which must not be mistaken for someone else's change.
+	 * The change event for our write will bring us back here.
+	 */
+	pthread_mutex_lock(&sb->lock);
+	bool busy = sb->mbox_full || sb->inflight;
+	pthread_mutex_unlock(&sb->lock);
+	if (busy)
+		return 0;
+
+	intmax_t r = attr_read_int(sb->brightness_rfd);
+	if (r < 0)
+		return r;
+
+	if ((uintmax_t)r > sb->max_brightness)
+		return -5;
+
+	if ((uint32_t)r == sb->raw)
+		return 0;
+
+	/* whoever changed it wins over any fade we were doing */
+	sb->raw = r;
+	sb->target = sb->pos = curve_raw_to_pos(&sb->curve, r);
+	sb->fade_len = 0;
+	sb->dimmed = false;
+	sb->off = false;
+	sys_backlight_save(sb);
+	pr_debug("sync: %s raw=%jd, pos=%"PRIu32"\n", sb->path, r, sb->target);
+	return 1;
+}
+
+/*
+ * Show @pos, writing the raw value only if it differs from the one the
+ * backlight is already at (or on its way to). The write itself happens on the
+ * backlight's worker, which reports its own errors.
+ */
+static
+int sys_backlight_show(struct sys_backlight *sb, uint32_t pos)
+{
+	uint32_t v = curve_pos_to_raw(&sb->curve, pos);
+
+	sb->pos = pos;
+	if (v == sb->raw) {
+		/* an input that ends up changing nothing isn't traced */
+		if (!sb->fade_len)
+			sb->trace.event = 0;
+		return 0;
+	}
+
+	struct lat_stamp st = sb->trace;
+	if (st.event)
+		st.post = lat_now();
+	sb->trace.event = 0;
+
+	ILLUM_PROBE3(post, sb->name, v, pos);
+	sb->raw = v;
+	sys_backlight_post(sb, v, &st);
+	return 0;
+}
+
+/*
+ * Move the target to @target. With a non-zero @fade_len the change is
+ * applied over time by sys_backlight_fade_frame(), starting from wherever
+ * the backlight currently is (so a new target mid-fade redirects the fade
+ * rather than queuing another one).
+ *
+ * Returns 1 if a fade is now in progress, 0 if the target was applied
+ * directly, or negative on error.
+ */
+static
+int sys_backlight_retarget(struct sys_backlight *sb, uint32_t target,
+		ev_tstamp fade_len, ev_tstamp now)
+{
+	pr_debug("retarget: %s pos=%"PRIu32" target=%"PRIu32" -> %"PRIu32"\n",
+			sb->path, sb->pos, sb->target, target);
+
+	/* anything but turning it off again turns it on */
+	sb->target = target;
+	sb->off = false;
+	sb->als_fade = false;
+	sys_backlight_save(sb);
+	if (fade_len <= 0 || sb->pos == target) {
+		sb->fade_len = 0;
+		return sys_backlight_show(sb, target);
+	}
+
+	sb->fade_from = sb->pos;
+	sb->fade_start = now;
+	sb->fade_len = fade_len;
+	return 1;
+}
+
+/*
+ * Advance a fade to @now. Frames where the raw value does not change are
+ * not written.
+ *
+ * Returns 1 if the fade continues, 0 if it has settled, or negative on error
+ * (which also ends the fade).
+ */
+static
+int sys_backlight_fade_frame(struct sys_backlight *sb, ev_tstamp now)
+{
+	if (!sb->fade_len)
+		return 0;
+
+	ev_tstamp t = (now - sb->fade_start) / sb->fade_len;
+	uint32_t pos;
+	if (t >= 1) {
+		sb->fade_len = 0;
+		pos = sb->target;
+	} else {
+		int64_t d = (int64_t)sb->target - sb->fade_from;
+		pos = sb->fade_from + (int64_t)(d * t);
+	}
+
+	int r = sys_backlight_show(sb, pos);
+	if (r < 0) {
+		sb->fade_len = 0;
+		return r;
+	}
+
+	return !!sb->fade_len;
+}
+
+/*
+ * Adjust the target by @mod. The target is kept in memory (with more
+ * precision than the raw value), so this never reads from sysfs and only
+ * writes if the raw value actually changes.
+ */
+static
+int sys_backlight_brightness_mod(struct sys_backlight *sb, int32_t mod,
+		const struct illum_conf *conf, ev_tstamp now)
+{
+	int64_t t = (int64_t)sb->target + mod;
+	uint32_t new = clamp(t, (int64_t)0, (int64_t)CURVE_POS_ONE);
+
+	return sys_backlight_retarget(sb, new,
+			new > sb->pos ? conf->fade_up : conf->fade_down, now);
+}
+
+/*
+ * A panel is identified by the GPU driving it: acpi_video0 hangs directly off
+ * the GPU's PCI device while intel_backlight, amdgpu_bl0 & co hang off a
+ * connector below it, so the closest PCI ancestor is the same for both.
+ * Platform drivers (thinkpad_screen, pwm-backlight) have no PCI ancestor and
+ * get NULL.
+ */
+static
+char *sys_backlight_panel(const char *path)
+{
+	char *dev = realpath(path, NULL);
+	if (!dev)
+		return NULL;
+
+	size_t len = strlen(dev);
+	char *buf = malloc(len + sizeof("/subsystem"));
+	if (!buf)
+		goto out;
+
+	for (;;) {
+		char *slash = strrchr(dev, '/');
+		if (!slash || slash == dev)
+			break;
+		*slash = '\0';
+
+		char link[PATH_MAX];
+		sprintf(buf, "%s/subsystem", dev);
+		ssize_t l = readlink(buf, link, sizeof(link) - 1);
+		if (l == -1)
+			continue;
+		link[l] = '\0';
+
+		const char *sub = strrchr(link, '/');
+		if (streq(sub ? sub + 1 : link, "pci")) {
+			free(buf);
+			return dev;
+		}
+	}
+
+	free(buf);
+out:
+	free(dev);
+	return NULL;
+}
+
+static
+enum bl_type sys_backlight_type(int dir_fd)
+{
+	char buf[32];
+	if (attr_read_str_at(dir_fd, "type", buf, sizeof(buf)) < 0)
+		return BL_UNKNOWN;
+
+	unsigned i;
+	for (i = 0; i < ARRAY_SIZE(bl_type_names); i++)
+		if (streq(buf, bl_type_names[i]))
+			return i;
+
+	return BL_UNKNOWN;
+}
+
+static
+int sys_backlight_new(struct sys_backlight **sb_, const char *path,
+		const struct curve_params *curve)
+{
+	struct sys_backlight *sb = malloc(sizeof(*sb));
+	if (!sb) {
+		return -ENOMEM;
+	}
+
+	int r = -ENOMEM;
+	sb->path = strdup(path);
+	if (!sb->path)
+		goto e_alloc;
+
+	const char *slash = strrchr(sb->path, '/');
+	sb->name = slash ? slash + 1 : sb->path;
+
+	sb->dir_fd = open(sb->path, O_RDONLY | O_DIRECTORY);
+	if (sb->dir_fd == -1) {
+		r = -1;
+		goto e_alloc_p;
+	}
+
+	r = sys_backlight_init_max_brightness(sb);
+	if (r < 0) {
+		goto e_close;
+	}
+
+	sb->brightness_rfd = attr_open(sb->dir_fd, "brightness", O_RDONLY);
+	if (sb->brightness_rfd == -1) {
+		r = -5;
+		goto e_close;
+	}
+
+	sb->brightness_wfd = attr_open(sb->dir_fd, "brightness", O_WRONLY);
+	if (sb->brightness_wfd == -1) {
+		r = -6;
+		goto e_close_rfd;
+	}
+
+	r = curve_init(&sb->curve, curve, sb->max_brightness);
+	if (r < 0) {
+		r = -8;
+		goto e_close_wfd;
+	}
+
+	sb->type = sys_backlight_type(sb->dir_fd);
+	sb->panel = sys_backlight_panel(sb->path);
+	/* until backlights_select() says otherwise */
+	sb->active = false;
+
+	sb->raw = UINT32_MAX;
+	sb->fade_len = 0;
+	sb->als_fade = false;
+	sb->dimmed = false;
+	sb->off = false;
+	sb->saved = NULL;
+	sb->sub_permille = -1;
+	sb->sub_seq = 0;
+
+	sb->trace.event = 0;
+	sb->mbox_full = false;
+	sb->inflight = false;
+	sb->stop = false;
+	memset(sb->lat, 0, sizeof(sb->lat));
+	sb->writes = 0;
+	sb->write_errors = 0;
+	sb->superseded = 0;
+	pthread_mutex_init(&sb->lock, NULL);
+	pthread_cond_init(&sb->cond, NULL);
+
+	r = sys_backlight_brightness_sync(sb);
+	if (r < 0) {
+		r = -7;
+		goto e_pthread;
+	}
+
+	/* signals are for the event loop's thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&sb->worker, NULL, sys_backlight_worker, sb);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r) {
+		r = -9;
+		goto e_pthread;
+	}
+
+	pr_info("found backlight %s: type %s, max_brightness %ju, panel %s\n",
+			path, bl_type_names[sb->type], sb->max_brightness,
+			sb->panel ? sb->panel : "(none)");
+
+	*sb_ = sb;
+	return 0;
+
+e_pthread:
+	pthread_cond_destroy(&sb->cond);
+	pthread_mutex_destroy(&sb->lock);
+	free(sb->panel);
+e_close_wfd:
+	close(sb->brightness_wfd);
+e_close_rfd:
+	close(sb->brightness_rfd);
+e_close:
+	close(sb->dir_fd);
+e_alloc_p:
+	free(sb->path);
+e_alloc:
+	free(sb);
+	return r;
+}
+
+static
+void sys_backlight__delete(struct sys_backlight *sb)
+{
+	/* a write in progress is waited for, a queued one is dropped */
+	pthread_mutex_lock(&sb->lock);
+	sb->stop = true;
+	pthread_cond_signal(&sb->cond);
+	pthread_mutex_unlock(&sb->lock);
+	pthread_join(sb->worker, NULL);
+	pthread_cond_destroy(&sb->cond);
+	pthread_mutex_destroy(&sb->lock);
+
+	list_del(&sb->list);
+	close(sb->brightness_wfd);
+	close(sb->brightness_rfd);
+	close(sb->dir_fd);
+	free(sb->panel);
+	free(sb->path);
+	free(sb);
+}
+
+static int
+bl_override_find(const struct illum_conf *conf, const char *name)
+{
+	size_t i;
+	/* the last -b for a backlight wins */
+	for (i = conf->bl_override_ct; i--;) {
+		if (streq(conf->bl_overrides[i].name, name))
+			return conf->bl_overrides[i].use ? 1 : -1;
+	}
+
+	return 0;
+}
+
+/* a total order, so exactly one backlight per panel comes out on top */
+static bool
+sys_backlight_better(const struct sys_backlight *a, const struct sys_backlight *b)
+{
+	if (a->type != b->type)
+		return a->type > b->type;
+	if (a->max_brightness != b->max_brightness)
+		return a->max_brightness > b->max_brightness;
+	return strcmp(a->name, b->name) < 0;
+}
+
+static bool
+panel_eq(const char *a, const char *b)
+{
+	return a == b || (a && b && streq(a, b));
+}
+
+/*
+ * How the state file knows a backlight across boots: its name below the
+ * panel's PCI device, so backlights of the same name on two GPUs are told
+ * apart.
+ */
+static void
+sys_backlight_state_id(const struct sys_backlight *sb, char *buf, size_t sz)
+{
+	const char *panel = sb->panel;
+	if (panel && strstarts(panel, "/sys/devices/"))
+		panel += strlen("/sys/devices/");
+
+	snprintf(buf, sz, "%s%s%s", panel ? panel : "", panel ? "/" : "", sb->name);
+}
+
+/*
+ * Put @sb back where it was left (the write goes out right away on its
+ * worker) and save its changes from now on. Only for backlights that are
+ * written, see backlights_select().
+ */
+static void
+sys_backlight_restore(struct sys_backlight *sb, struct state_file *sf)
+{
+	char id[PATH_MAX];
+	sys_backlight_state_id(sb, id, sizeof(id));
+
+	struct state_slot *ss = state_slot(sf, id);
+	if (!ss) {
+		pr_warn("state: no room for %s, its level won't be kept\n", id);
+		return;
+	}
+
+	if (ss->flags & STATE_SLOT_SET) {
+		pr_info("state: restoring %s to %"PRIu32"\n", sb->path, ss->pos);
+		sys_backlight_retarget(sb, min(ss->pos, CURVE_POS_ONE), 0, 0);
+	}
+
+	sb->saved = ss;
+	sys_backlight_save(sb);
+}
+
+/*
+ * Backlight selection
+ *
+ * Laptops commonly expose the same panel more than once (acpi_video0 next to
+ * intel_backlight or amdgpu_bl0). Writing all of them doubles the cost of
+ * every step (the firmware ones often go through ACPI and are slow) and makes
+ * steps land twice, so only one backlight per panel is written.
+ *
+ * Per panel we prefer raw over platform over firmware: the raw interface
+ * goes straight to the GPU's PWM and where the kernel leaves a firmware
+ * interface registered next to it, the firmware one is usually the coarse
+ * and slow one. Ties go to the finer max_brightness. Backlights without a PCI
+ * parent are assumed to drive the same panel as the first one that has one
+ * (the internal panel on the only or primary GPU).
+ *
+ * -b forces a backlight in or out. Any forced in backlight of a panel
+ * replaces the selection for that panel, so several can be forced in.
+ *
+ * A backlight is restored from the state file when it is first used, so the
+ * ones left out never get a slot or the (possibly slow) restore write.
+ *
+ * Run whenever a backlight is added or removed.
+ */
+static void
+backlights_select(struct illum *illum)
+{
+	const char *fallback = NULL;
+	struct sys_backlight *bl, *o;
+
+	tlist2_for_each(&illum->backlights, bl) {
+		if (bl->panel) {
+			fallback = bl->panel;
+			break;
+		}
+	}
+
+	tlist2_for_each(&illum->backlights, bl) {
+		const char *panel = bl->panel ? bl->panel : fallback;
+		int ov = bl_override_find(&illum->conf, bl->name);
+		bool active = ov >= 0;
+
+		if (!ov) {
+			tlist2_for_each(&illum->backlights, o) {
+				const char *o_panel = o->panel ? o->panel : fallback;
+				int o_ov;
+				if (o == bl || !panel_eq(panel, o_panel))
+					continue;
+
+				o_ov = bl_override_find(&illum->conf, o->name);
+				if (o_ov > 0 || (!o_ov && sys_backlight_better(o, bl))) {
+					active = false;
+					break;
+				}
+			}
+		}
+
+		if (active == bl->active)
+			continue;
+
+		pr_info("%s backlight %s\n", active ? "using" : "not using", bl->path);
+		bl->active = active;
+		if (active && !bl->saved && illum->state)
+			sys_backlight_restore(bl, illum->state);
+		if (!active) {
+			/* leave it wherever it is */
+			bl->target = bl->pos;
+			bl->fade_len = 0;
+			bl->dimmed = false;
+			bl->trace.event = 0;
+		}
+	}
+}
+
+int illum_backlight_add(struct illum *illum, const char *path)
+{
+	struct sys_backlight *sb;
+	int r = sys_backlight_new(&sb, path, &illum->conf.curve);
+	if (r < 0)
+		return r;
+
+	tlist2_add(&illum->backlights, sb);
+	backlights_select(illum);
+	return 0;
+}
+
+/*
+ * Runs at conf.fade_rate while any backlight is fading, and stops itself once
+ * they have all settled.
+ */
+static void
+illum_fade_cb(EV_P_ ev_timer *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_fade);
+	wake_note(EV_A_ WAKE_FADE);
+	ev_tstamp now = ev_now(EV_A);
+	bool fading = false;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		int r = sys_backlight_fade_frame(bl, now);
+		if (r < 0)
+			pr_warn("fade: failed to set %s: %d\n", bl->path, r);
+		else if (r)
+			fading = true;
+	}
+
+	if (!fading)
+		ev_timer_stop(EV_A_ w);
+}
+
+static void
+illum__fade_start(struct illum *illum EV_P__)
+{
+	if (ev_is_active(&illum->w_fade))
+		return;
+
+	illum->w_fade.repeat = 1. / illum->conf.fade_rate;
+	ev_timer_again(EV_A_ &illum->w_fade);
+}
+
+/*
+ * Auto-brightness
+ *
+ * Readings are smoothed with an exponential moving average of log10(1 + lux)
+ * over ALS_TAU seconds, which follows how brightness is perceived, and the
+ * backlights only follow once the average has moved ALS_HYST from where they
+ * were last set for. Flicker and passing shadows cost a few flops per sample.
+ *
+ * The default mapping puts darkness at ALS_POS_DARK and each decade of lux
+ * ALS_POS_DECADE higher along the curve, and is corrected by what the keys
+ * (and illum-ctl) teach it: whenever the user changes the brightness, the
+ * difference to what the mapping gave for the current level is added to the
+ * bands either side of it, so the mapping gives exactly that from then on
+ * and nearby levels follow along.
+ */
+#define ALS_TAU 4.
+#define ALS_HYST 0.15
+#define ALS_FADE 2.
+/* ALS_BINS of these cover 0 to 100000 lux */
+#define ALS_BIN_WIDTH (5. / ALS_BINS)
+#define ALS_POS_DARK CURVE_POS_PERCENT(15)
+#define ALS_POS_DECADE CURVE_POS_PERCENT(17)
+
+/* the learned offset at @level, interpolated between the bands' centers */
+static int32_t
+als_offset(const struct illum *illum, double level, unsigned *bin, double *frac)
+{
+	const int32_t *o = illum->als.offset;
+	double x = level / ALS_BIN_WIDTH - 0.5;
+
+	if (x <= 0) {
+		*bin = 0;
+		*frac = 0;
+	} else if (x >= ALS_BINS - 1) {
+		*bin = ALS_BINS - 1;
+		*frac = 0;
+	} else {
+		*bin = x;
+		*frac = x - *bin;
+	}
+
+	if (!*frac)
+		return o[*bin];
+	return o[*bin] + (int32_t)((o[*bin + 1] - o[*bin]) * *frac);
+}
+
+static uint32_t
+als_pos(const struct illum *illum, double level)
+{
+	unsigned bin;
+	double frac;
+	int64_t pos = ALS_POS_DARK + (int64_t)(level * ALS_POS_DECADE) +
+		als_offset(illum, level, &bin, &frac);
+	return clamp(pos, (int64_t)0, (int64_t)CURVE_POS_ONE);
+}
+
+/* the user just put the brightness at @target */
+static void
+illum__als_learn(struct illum *illum, uint32_t target)
+{
+	if (!illum->als.settled)
+		return;
+
+	unsigned bin;
+	double frac;
+	double level = illum->als.level;
+	int64_t want = (int64_t)target - ALS_POS_DARK - (int64_t)(level * ALS_POS_DECADE);
+	int32_t d = want - als_offset(illum, level, &bin, &frac);
+
+	illum->als.offset[bin] += d;
+	if (frac)
+		illum->als.offset[bin + 1] += d;
+
+	/* and don't undo it on the next sample */
+	illum->als.applied = level;
+	illum->als.learned++;
+	pr_debug("als: learned %+"PRId32" at level %.2f\n", d, level);
+}
+
+void illum_als_sample(struct illum *illum, double lux EV_P__)
+{
+	ev_tstamp now = ev_now(EV_A);
+	double level = log10(1 + max(lux, 0.));
+
+	illum->als.samples++;
+	if (!illum->als.last) {
+		illum->als.level = level;
+	} else {
+		double a = 1 - exp(-(now - illum->als.last) / ALS_TAU);
+		illum->als.level += a * (level - illum->als.level);
+	}
+	illum->als.last = now;
+
+	if (illum->als.settled && fabs(illum->als.level - illum->als.applied) < ALS_HYST)
+		return;
+
+	/*
+	 * "all" is the broadest inhibit, so only its own count matters. While
+	 * dimmed undimming restores the user's level and we catch up after.
+	 */
+	if (illum->inhibit_ct[INHIBIT_ALL] || illum->dimmed)
+		return;
+
+	uint32_t pos = als_pos(illum, illum->als.level);
+	bool fading = false;
+
+	pr_debug("als: level %.2f, moving to %"PRIu32"\n", illum->als.level, pos);
+	illum->als.settled = true;
+	illum->als.applied = illum->als.level;
+	illum->als.changes++;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		/* turned off stays off */
+		if (!bl->active || bl->off)
+			continue;
+
+		int r = sys_backlight_retarget(bl, pos, ALS_FADE, now);
+		if (r < 0)
+			pr_warn("als: failed to set %s: %d\n", bl->path, r);
+		else if (r)
+			fading = bl->als_fade = true;
+	}
+
+	if (fading)
+		illum__fade_start(illum EV_A__);
+}
+
+void illum_als_stop(struct illum *illum EV_P__)
+{
+	(void)EV_A;
+	illum->als.on = false;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		if (!bl->als_fade || !bl->fade_len)
+			continue;
+
+		/* illum_fade_cb() stops itself once nothing fades */
+		bl->target = bl->pos;
+		bl->fade_len = 0;
+		bl->als_fade = false;
+		sys_backlight_save(bl);
+	}
+}
+
+/*
+ * Apply the steps queued by illum__brightness_mod() during this loop
+ * iteration, so each backlight sees at most one retarget no matter how many
+ * events (from however many devices) arrived.
+ */
+static void
+illum_flush_cb(EV_P_ ev_prepare *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_flush);
+	wake_note(EV_A_ WAKE_FLUSH);
+	int64_t mod = illum->pending_mod;
+	struct lat_stamp st = illum->pending_stamp;
+
+	ev_prepare_stop(EV_A_ w);
+	illum->pending_mod = 0;
+	illum->pending_stamp.event = 0;
+	illum->stats.flushes++;
+
+	if (!mod)
+		return;
+
+	/* more than a full sweep is the same as a full sweep */
+	mod = clamp(mod, -(int64_t)CURVE_POS_ONE, (int64_t)CURVE_POS_ONE);
+
+	ev_tstamp now = ev_now(EV_A);
+	bool fading = false;
+	/* from the first backlight, they all moved alike */
+	bool learn = illum->als.on;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		if (!bl->active)
+			continue;
+
+		/* the oldest input still waiting to be shown is the one to time */
+		if (st.event && !bl->trace.event)
+			bl->trace = st;
+
+		int r = sys_backlight_brightness_mod(bl, mod, &illum->conf, now);
+		if (r < 0)
+			pr_warn("failed to set %s: %d\n", bl->path, r);
+		else if (r)
+			fading = true;
+
+		if (learn) {
+			illum__als_learn(illum, bl->target);
+			learn = false;
+		}
+	}
+
+	if (fading)
+		illum__fade_start(illum EV_A__);
+}
+
+static void
+illum__brightness_mod(struct illum *illum, int32_t mod EV_P__)
+{
+	illum->pending_mod += mod;
+	illum->stats.events++;
+
+	if (!ev_is_active(&illum->w_flush))
+		ev_prepare_start(EV_A_ &illum->w_flush);
+}
+
+static void
+illum_stats_cb(EV_P_ ev_signal *w, int revents)
+{
+	(void)revents;
+	(void)EV_A;
+
+	struct illum *illum = container_of(w, struct illum, w_stats);
+	wake_note(EV_A_ WAKE_SIGNAL);
+	pr_info("stats: %ju brightness events in %ju flushes\n",
+			illum->stats.events, illum->stats.flushes);
+	pr_info("stats: %ju input devices seen, %ju opened, %ju probed\n",
+			illum->stats.input_seen, illum->stats.input_opens,
+			illum->stats.input_probes);
+	pr_info("stats: %ju hotplugged inputs queued, %ju removed before probing\n",
+			illum->stats.input_queued, illum->stats.input_collapsed);
+	pr_info("stats: %ju control requests from %ju clients\n",
+			illum->stats.ctl_requests, illum->stats.ctl_clients);
+	pr_info("stats: %ju brightness changes pushed %ju times to subscribers\n",
+			illum->stats.ctl_changes, illum->stats.ctl_pushes);
+	pr_info("stats: %ju inhibits, %u dim and %u all held now\n",
+			illum->stats.inhibits, illum->inhibit_ct[INHIBIT_DIM],
+			illum->inhibit_ct[INHIBIT_ALL]);
+	pr_info("stats: %ju wakeups, %.1f ms CPU in callbacks\n",
+			illum->wake.wakeups, illum->wake.cpu_ns / 1e6);
+	unsigned s;
+	for (s = 0; s < WAKE_SRC_CT; s++) {
+		const struct wake_stat *ws = &illum->wake.src[s];
+		if (ws->calls || ws->wakeups)
+			pr_info("stats: wakeups: %s: %ju woke us, %ju callbacks, %.1f ms CPU\n",
+					wake_src_names[s], ws->wakeups, ws->calls,
+					ws->cpu_ns / 1e6);
+	}
+	if (illum->als.on)
+		pr_info("stats: als: %ju samples, %ju changes, %ju learned, now %.0f lux\n",
+				illum->als.samples, illum->als.changes,
+				illum->als.learned, pow(10, illum->als.level) - 1);
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		pthread_mutex_lock(&bl->lock);
+		uintmax_t writes = bl->writes, errors = bl->write_errors,
+			  superseded = bl->superseded;
+		pthread_mutex_unlock(&bl->lock);
+		pr_info("stats: %s: %s, %ju writes (%ju failed), %ju superseded before being written\n",
+				bl->path, bl->active ? "active" : "inactive",
+				writes, errors, superseded);
+
+		pthread_mutex_lock(&bl->lock);
+		struct lat_hist lat[LAT_STAGE_CT];
+		memcpy(lat, bl->lat, sizeof(lat));
+		pthread_mutex_unlock(&bl->lock);
+
+		unsigned i;
+		for (i = 0; i < LAT_STAGE_CT; i++) {
+			char buf[512];
+			if (!lat[i].n)
+				continue;
+			lat_hist_fmt(&lat[i], buf, sizeof(buf));
+			pr_info("stats: %s: latency %s: n=%ju p50<=%juus p99<=%juus max=%juus [%s]\n",
+					bl->name, lat_stage_names[i], (uintmax_t)lat[i].n,
+					(uintmax_t)lat_hist_pct_us(&lat[i], 50),
+					(uintmax_t)lat_hist_pct_us(&lat[i], 99),
+					(uintmax_t)lat[i].max_ns / 1000, buf);
+		}
+	}
+
+	struct input_htable_iter it;
+	struct input_dev *id;
+	for (id = input_htable_first(&illum->inputs, &it); id;
+			id = input_htable_next(&illum->inputs, &it)) {
+		pr_info("stats: input "DEVNUM_FMT": %ju wakeups, %ju events\n",
+				DEVNUM_EXP(id->devnum), id->wakeups, id->events);
+	}
+}
+
+/*
+ * Idle dimming
+ *
+ * Input events only record ev_now() in last_activity (and check whether we
+ * are dimmed). w_idle is not re-armed per event: when it fires it works out
+ * how long ago the last activity really was and either re-arms itself for
+ * the remainder or dims.
+ */
+static void
+illum__dim(struct illum *illum EV_P__)
+{
+	ev_tstamp now = ev_now(EV_A);
+	bool fading = false;
+
+	pr_debug("idle: dimming\n");
+	illum->dimmed = true;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		/* never brighten to "dim" */
+		if (!bl->active || bl->target <= illum->conf.dim_level)
+			continue;
+
+		bl->undim_target = bl->target;
+		bl->dimmed = true;
+		int r = sys_backlight_retarget(bl, illum->conf.dim_level,
+				illum->conf.fade_down, now);
+		if (r < 0)
+			pr_warn("idle: failed to dim %s: %d\n", bl->path, r);
+		else if (r)
+			fading = true;
+	}
+
+	if (fading)
+		illum__fade_start(illum EV_A__);
+}
+
+static void
+illum__idle_start(struct illum *illum EV_P__)
+{
+	illum->last_activity = ev_now(EV_A);
+	illum->w_idle.repeat = illum->conf.idle_timeout;
+	ev_timer_again(EV_A_ &illum->w_idle);
+}
+
+static void
+illum__undim(struct illum *illum EV_P__)
+{
+	ev_tstamp now = ev_now(EV_A);
+	bool fading = false;
+
+	pr_debug("idle: activity, undimming\n");
+	illum->dimmed = false;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		/* cleared if something else changed the brightness */
+		if (!bl->dimmed)
+			continue;
+
+		bl->dimmed = false;
+		int r = sys_backlight_retarget(bl, bl->undim_target,
+				illum->conf.fade_up, now);
+		if (r < 0)
+			pr_warn("idle: failed to undim %s: %d\n", bl->path, r);
+		else if (r)
+			fading = true;
+	}
+
+	if (fading)
+		illum__fade_start(illum EV_A__);
+
+	illum__idle_start(illum EV_A__);
+}
+
+/* is @what inhibited, either directly or by a broader inhibit? */
+static bool
+illum__inhibited(struct illum *illum, enum inhibit what)
+{
+	unsigned i;
+	for (i = what; i < INHIBIT_CT; i++)
+		if (illum->inhibit_ct[i])
+			return true;
+	return false;
+}
+
+static void
+illum_idle_cb(EV_P_ ev_timer *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_idle);
+	wake_note(EV_A_ WAKE_IDLE);
+
+	/* inhibit_get() stops us, this is just in case */
+	if (illum__inhibited(illum, INHIBIT_DIM)) {
+		ev_timer_stop(EV_A_ w);
+		return;
+	}
+
+	ev_tstamp after = illum->last_activity - ev_now(EV_A) + illum->conf.idle_timeout;
+
+	if (after > 0) {
+		w->repeat = after;
+		ev_timer_again(EV_A_ w);
+		return;
+	}
+
+	ev_timer_stop(EV_A_ w);
+	illum__dim(illum EV_A__);
+}
+
+/* the per-event cost of idle tracking */
+static inline void
+illum__activity(struct illum *illum EV_P__)
+{
+	illum->last_activity = ev_now(EV_A);
+	if (__builtin_expect(illum->dimmed, 0))
+		illum__undim(illum EV_A__);
+}
+
+/*
+ * Held keys step after a delay (like the kernel's autorepeat) and then once
+ * per hold_interval, growing linearly from 1/HOLD_STEP_DIV of the key's step
+ * to all of it over HOLD_ACCEL seconds. The kernel's own repeat events are only used to notice
+ * keys that were already down when we started, so the number of steps (and
+ * so writes) is bounded by hold_interval regardless of the repeat rate.
+ */
+#define HOLD_DELAY 0.3
+#define HOLD_ACCEL 1.5
+#define HOLD_STEP_DIV 5
+
+static const int hold_key_dir[HOLD_KEY_CT] = {
+	[HOLD_UP] = 1,
+	[HOLD_DOWN] = -1,
+};
+
+static void
+illum_hold_cb(EV_P_ ev_timer *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_hold);
+	wake_note(EV_A_ WAKE_HOLD);
+	ev_tstamp held = ev_now(EV_A) - illum->hold_start - HOLD_DELAY;
+	int32_t max = illum->hold_step[illum->hold_dir > 0 ? HOLD_UP : HOLD_DOWN];
+	int32_t step = max;
+	if (held < HOLD_ACCEL)
+		step = max / HOLD_STEP_DIV + (max - max / HOLD_STEP_DIV) * (held / HOLD_ACCEL);
+
+	illum__brightness_mod(illum, illum->hold_dir * step EV_A__);
+}
+
+/*
+ * @code, bound to a step of @step, went down. Returns true if this is a new
+ * press (rather than a repeat).
+ */
+static bool
+illum__key_down(struct illum *illum, struct input_dev *id, unsigned code,
+		int32_t step EV_P__)
+{
+	enum hold_key k = step > 0 ? HOLD_UP : HOLD_DOWN;
+	if (id->held & (1u << k) && id->hold_code[k] == code)
+		return false;
+
+	/* another key for the same direction takes over */
+	if (!(id->held & (1u << k)))
+		illum->hold_ct[k]++;
+	id->held |= 1u << k;
+	id->hold_code[k] = code;
+	illum->hold_step[k] = labs(step);
+	illum->hold_dir = hold_key_dir[k];
+	illum->hold_start = ev_now(EV_A);
+
+	ev_timer_stop(EV_A_ &illum->w_hold);
+	ev_timer_set(&illum->w_hold, HOLD_DELAY, illum->conf.hold_interval);
+	ev_timer_start(EV_A_ &illum->w_hold);
+	return true;
+}
+
+static void
+illum__key_up(struct illum *illum, struct input_dev *id, enum hold_key k EV_P__)
+{
+	if (!(id->held & (1u << k)))
+		return;
+
+	id->held &= ~(1u << k);
+	illum->hold_ct[k]--;
+	if (illum->hold_ct[k] || illum->hold_dir != hold_key_dir[k])
+		return;
+
+	/* fall back to the other key if it is still held */
+	unsigned i;
+	for (i = 0; i < HOLD_KEY_CT; i++) {
+		if (illum->hold_ct[i]) {
+			illum->hold_dir = hold_key_dir[i];
+			illum->hold_start = ev_now(EV_A);
+			return;
+		}
+	}
+
+	illum->hold_dir = 0;
+	ev_timer_stop(EV_A_ &illum->w_hold);
+}
+
+static void
+input_dev__delete(struct input_dev *id EV_P__)
+{
+	int ifd = id->w.fd;
+	unsigned k;
+	for (k = 0; k < HOLD_KEY_CT; k++)
+		illum__key_up(id->parent, id, k EV_A__);
+
+	input_htable_del(&id->parent->inputs, id);
+	ev_io_stop(EV_A_ &id->w);
+	libevdev_free(id->dev);
+	free(id);
+	close(ifd);
+}
+
+#define BITS_PER_LONG (sizeof(unsigned long) * CHAR_BIT)
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static void
+bitmap_set(unsigned long *map, unsigned bit)
+{
+	map[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+/*
+ * Ask the kernel to only deliver the bound keys from this device. Everything
+ * else (other keys, EV_MSC scancodes, etc) is dropped in evdev, and packets
+ * that end up empty don't wake us at all, so typing on a keyboard that also
+ * has brightness keys costs us nothing.
+ *
+ * With @activity (idle dimming needs to see typing and pointer motion) only
+ * the event types that don't indicate activity are dropped.
+ *
+ * Returns 0 on success or a negative errno. Kernels before 4.4 lack
+ * EVIOCSMASK (ENOTTY/EINVAL), in which case we get every event and filter
+ * them in evdev_cb() as before.
+ */
+static int
+input_dev_mask_events(int fd, bool activity, const struct keymap *km)
+{
+#ifdef EVIOCSMASK
+	unsigned long types[BITS_TO_LONGS(EV_CNT)] = { 0 };
+	unsigned long keys[BITS_TO_LONGS(KEY_CNT)] = { 0 };
+	size_t i;
+
+	bitmap_set(types, EV_KEY);
+	if (activity) {
+		bitmap_set(types, EV_REL);
+		bitmap_set(types, EV_ABS);
+	}
+
+	/* the EV_SYN mask selects which event types are delivered */
+	struct input_mask m = {
+		.type = EV_SYN,
+		.codes_size = sizeof(types),
+		.codes_ptr = (uintptr_t)types,
+	};
+	if (ioctl(fd, EVIOCSMASK, &m) == -1)
+		return -errno;
+
+	/* all of them, which also undoes an earlier mask on a reconf */
+	if (activity)
+		memset(keys, 0xff, sizeof(keys));
+	for (i = 0; !activity && i < km->key_ct; i++)
+		bitmap_set(keys, km->keys[i]);
+	for (i = 0; !activity && km->mods_used && i < ARRAY_SIZE(keymap_mod_keys); i++)
+		bitmap_set(keys, keymap_mod_keys[i]);
+
+	m = (struct input_mask) {
+		.type = EV_KEY,
+		.codes_size = sizeof(keys),
+		.codes_ptr = (uintptr_t)keys,
+	};
+	if (ioctl(fd, EVIOCSMASK, &m) == -1)
+		return -errno;
+
+	return 0;
+#else
+	(void)fd;
+	(void)activity;
+	(void)km;
+	return -ENOSYS;
+#endif
+}
+
+/*
+ * Turn every active backlight off, remembering where each was, or if any
+ * are off, turn those back on.
+ */
+static void
+illum__off_toggle(struct illum *illum, const struct lat_stamp *st EV_P__)
+{
+	ev_tstamp now = ev_now(EV_A);
+	bool fading = false, any_off = false;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl)
+		any_off |= bl->active && bl->off;
+
+	tlist2_for_each(&illum->backlights, bl) {
+		if (!bl->active || (any_off && !bl->off))
+			continue;
+
+		if (st->event && !bl->trace.event)
+			bl->trace = *st;
+
+		int r;
+		if (any_off) {
+			r = sys_backlight_retarget(bl, bl->off_target,
+					illum->conf.fade_up, now);
+		} else {
+			bl->off_target = bl->dimmed ? bl->undim_target : bl->target;
+			bl->dimmed = false;
+			r = sys_backlight_retarget(bl, 0, illum->conf.fade_down, now);
+			bl->off = true;
+			/* what comes back at the next start is the level before */
+			sys_backlight_save(bl);
+		}
+
+		if (r < 0)
+			pr_warn("failed to set %s: %d\n", bl->path, r);
+		else if (r)
+			fading = true;
+	}
+
+	if (fading)
+		illum__fade_start(illum EV_A__);
+}
+
+/* move every active backlight to @pos, with a fade if @fade */
+static void
+illum__brightness_set(struct illum *illum, uint32_t pos, bool fade,
+		const struct lat_stamp *st EV_P__)
+{
+	ev_tstamp now = ev_now(EV_A);
+	bool fading = false;
+	bool learn = illum->als.on;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		if (!bl->active)
+			continue;
+
+		if (st->event && !bl->trace.event)
+			bl->trace = *st;
+
+		bl->dimmed = false;
+		int r = sys_backlight_retarget(bl, pos, !fade ? 0 :
+				pos > bl->pos ? illum->conf.fade_up : illum->conf.fade_down,
+				now);
+		if (r < 0)
+			pr_warn("failed to set %s: %d\n", bl->path, r);
+		else if (r)
+			fading = true;
+
+		if (learn) {
+			illum__als_learn(illum, pos);
+			learn = false;
+		}
+	}
+
+	if (fading)
+		illum__fade_start(illum EV_A__);
+}
+
+/*
+ * Handle one event from a key device (or a replay of one): a single lookup
+ * in the keymap for the key and the device's modifier state.
+ */
+static void
+input_dev_event(struct input_dev *id, const struct input_event *ev,
+		uint64_t dispatch EV_P__)
+{
+	struct illum *illum = id->parent;
+	id->events++;
+
+	if (ev->type != EV_KEY || ev->code >= KEY_CNT)
+		return;
+
+	const struct keymap_entry *ke = keymap_lookup(&illum->conf.keymap,
+			ev->code, id->mods);
+
+	if (ke->act == KEYMAP_MOD) {
+		unsigned m;
+		if (ev->value)
+			id->mod_keys |= 1u << ke->arg;
+		else
+			id->mod_keys &= ~(1u << ke->arg);
+
+		/* left or right */
+		id->mods = 0;
+		for (m = 0; m < KEYMAP_MOD_BITS; m++)
+			if (id->mod_keys & (3u << (m * 2)))
+				id->mods |= 1u << m;
+		return;
+	}
+
+	/*
+	 * Releases end holds by key code, as the modifiers (and so the
+	 * binding) may have changed since the press.
+	 */
+	if (ev->value == 0) {
+		unsigned k;
+		for (k = 0; k < HOLD_KEY_CT; k++)
+			if (id->held & (1u << k) && id->hold_code[k] == ev->code)
+				illum__key_up(illum, id, k EV_A__);
+		return;
+	}
+
+	if (ke->act == KEYMAP_NONE)
+		return;
+
+	uint64_t t = (uint64_t)ev->input_event_sec * 1000000000
+		+ (uint64_t)ev->input_event_usec * 1000;
+	ILLUM_PROBE3(key, ev->code, ev->value, t);
+
+	struct lat_stamp st = { 0 };
+	if (id->mono) {
+		st.event = t;
+		st.dispatch = dispatch;
+	}
+
+	/*
+	 * Act on the press rather than the release. A repeat for a step key we
+	 * did not see go down is treated as a press, other actions ignore
+	 * repeats.
+	 */
+	if (ke->act == KEYMAP_STEP) {
+		if (illum__key_down(illum, id, ev->code, ke->arg EV_A__)) {
+			if (st.event && !illum->pending_stamp.event)
+				illum->pending_stamp = st;
+			illum__brightness_mod(illum, ke->arg EV_A__);
+		}
+		return;
+	}
+
+	if (ev->value != 1)
+		return;
+
+	illum->stats.events++;
+	switch (ke->act) {
+	case KEYMAP_SET:
+	case KEYMAP_PRESET:
+		illum__brightness_set(illum, ke->arg, ke->act == KEYMAP_PRESET,
+				&st EV_A__);
+		break;
+	case KEYMAP_OFF:
+		illum__off_toggle(illum, &st EV_A__);
+		break;
+	}
+}
+
+/*
+ * Append @n events to the -R recording. The format is just struct
+ * input_event, so a recording is replayed the same way as a device.
+ */
+static void
+illum__record(struct illum *illum, const struct input_event *evs, size_t n)
+{
+	size_t len = n * sizeof(*evs);
+	ssize_t r = write(illum->record_fd, evs, len);
+	if (r == (ssize_t)len)
+		return;
+
+	pr_warn("recording failed (%s), stopping it\n",
+			r == -1 ? strerror(errno) : "short write");
+	close(illum->record_fd);
+	illum->record_fd = -1;
+}
+
+static void
+evdev_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+	(void)EV_A;
+
+	struct input_dev *id = container_of(w, struct input_dev, w);
+	wake_note(EV_A_ WAKE_INPUT);
+	struct illum *illum = id->parent;
+	uint64_t dispatch = lat_now();
+	struct input_event rec[64];
+	size_t rec_ct = 0;
+
+	id->wakeups++;
+	illum__activity(illum EV_A__);
+	for (;;) {
+		struct input_event ev;
+		int r = libevdev_next_event(id->dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
+
+		/* no events */
+		if (r == -EAGAIN)
+			break;
+		else if (r == -ENODEV) {
+			pr_info("input device vanished: %s\n", libevdev_get_name(id->dev));
+			input_dev__delete(id EV_A__);
+			break;
+		}
+		else if (r < 0) {
+			pr_notice("error for libevdev device (%s): %d\n", libevdev_get_name(id->dev), -r);
+			break;
+		}
+
+		/* need sync??
+		 * FIXME: determine if we're handling this properly or if we
+		 * even really need to handle it.
+		 */
+		if (r == LIBEVDEV_READ_STATUS_SYNC)
+			continue;
+
+		assert(r == LIBEVDEV_READ_STATUS_SUCCESS);
+
+		if (illum->record_fd != -1) {
+			rec[rec_ct++] = ev;
+			if (rec_ct == ARRAY_SIZE(rec)) {
+				illum__record(illum, rec, rec_ct);
+				rec_ct = 0;
+			}
+		}
+
+		input_dev_event(id, &ev, dispatch EV_A__);
+
+		pr_devel("Event: %s %s %d\n",
+				libevdev_event_type_get_name(ev.type),
+				libevdev_event_code_get_name(ev.type, ev.code),
+				ev.value);
+	}
+
+	if (rec_ct && illum->record_fd != -1)
+		illum__record(illum, rec, rec_ct);
+}
+
+/*
+ * Replayed events, see illum_replay_add(). Writers hand over whole events
+ * (pipe writes of up to PIPE_BUF are atomic), so reads in multiples of the
+ * event size always end on an event boundary.
+ */
+static void
+replay_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct input_dev *id = container_of(w, struct input_dev, w);
+	wake_note(EV_A_ WAKE_INPUT);
+	uint64_t dispatch = lat_now();
+	struct input_event evs[64];
+
+	id->wakeups++;
+	illum__activity(id->parent EV_A__);
+	for (;;) {
+		ssize_t r = read(w->fd, evs, sizeof(evs));
+		if (r > 0) {
+			size_t i, n = r / sizeof(evs[0]);
+			if (r % sizeof(evs[0]))
+				pr_warn("replay "DEVNUM_FMT": dropping a partial event\n",
+						DEVNUM_EXP(id->devnum));
+			for (i = 0; i < n; i++)
+				input_dev_event(id, &evs[i], dispatch EV_A__);
+			if ((size_t)r < sizeof(evs))
+				break;
+			continue;
+		}
+
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && errno == EAGAIN)
+			break;
+
+		pr_info("replay "DEVNUM_FMT" ended\n", DEVNUM_EXP(id->devnum));
+		input_dev__delete(id EV_A__);
+		break;
+	}
+}
+
+/*
+ * For devices that are only watched for activity: the events themselves
+ * don't matter, so they are read in bulk and dropped.
+ */
+static void
+activity_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct input_dev *id = container_of(w, struct input_dev, w);
+	wake_note(EV_A_ WAKE_INPUT);
+	struct input_event evs[64];
+
+	id->wakeups++;
+	illum__activity(id->parent EV_A__);
+	for (;;) {
+		ssize_t r = read(w->fd, evs, sizeof(evs));
+		if (r > 0) {
+			id->events += r / sizeof(evs[0]);
+			if ((size_t)r < sizeof(evs))
+				break;
+			continue;
+		}
+
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && errno == EAGAIN)
+			break;
+
+		pr_info("input device vanished: "DEVNUM_FMT"\n", DEVNUM_EXP(id->devnum));
+		input_dev__delete(id EV_A__);
+		break;
+	}
+}
+
+/*
+ * Drop what an activity-only device queued while it wasn't watched, so it
+ * isn't taken for fresh activity. A device that went away meanwhile is left
+ * for activity_cb() to notice.
+ */
+static void
+input_dev_drain(struct input_dev *id)
+{
+	struct input_event evs[64];
+	for (;;) {
+		ssize_t r = read(id->w.fd, evs, sizeof(evs));
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+	}
+}
+
+static bool
+input_dev_has_keys(struct libevdev *dev, const struct keymap *km)
+{
+	size_t i;
+	for (i = 0; i < km->key_ct; i++)
+		if (libevdev_has_event_code(dev, EV_KEY, km->keys[i]))
+			return true;
+	return false;
+}
+
+/*
+ * Open the input device at @path, and if we want it add it to
+ * illum->inputs. Devices that might have bound keys (@keys) are probed with
+ * libevdev, others are only opened for activity tracking (if enabled).
+ *
+ * Returns 1 if it was added, 0 if it isn't interesting, or negative on
+ * error.
+ */
+static
+int input_dev_new(struct illum *illum, const char *path, dev_t devnum, bool keys EV_P__)
+{
+	bool activity = illum->conf.idle_timeout > 0;
+	if (!keys && !activity)
+		return 0;
+
+	illum->stats.input_opens++;
+	int ifd = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+	if (ifd < 0) {
+		fprintf(stderr, "could not open %s\n", path);
+		return -1;
+	}
+
+	int r = -ENOMEM;
+	struct input_dev *id = malloc(sizeof(*id));
+	if (!id)
+		goto e_close;
+
+	id->dev = NULL;
+	if (keys) {
+		illum->stats.input_probes++;
+		r = libevdev_new_from_fd(ifd, &id->dev);
+		if (r) {
+			pr_debug("could not init %s as libevdev device (%d)\n", path, r);
+			r = 0;
+			goto e_malloc;
+		}
+
+		/* Ignore devices we don't care about. */
+		if (!input_dev_has_keys(id->dev, &illum->conf.keymap)) {
+			if (!activity) {
+				pr_debug("input %s skipped due to lack of keys\n", path);
+				r = 0;
+				goto e_libevdev;
+			}
+
+			/* only watched for activity, drop the probe state */
+			libevdev_free(id->dev);
+			id->dev = NULL;
+		}
+	}
+
+	id->mono = false;
+	if (id->dev) {
+		/* comparable with lat_now(), for latency tracing */
+		id->mono = !libevdev_set_clock_id(id->dev, CLOCK_MONOTONIC);
+
+		r = input_dev_mask_events(ifd, activity, &illum->conf.keymap);
+		if (r < 0) {
+			static bool warned;
+			if (!warned)
+				pr_info("EVIOCSMASK unavailable (%d), filtering input events in userspace\n", r);
+			warned = true;
+		}
+	}
+
+	id->devnum = devnum;
+	id->parent = illum;
+	id->held = 0;
+	id->mod_keys = 0;
+	id->mods = 0;
+	id->wakeups = 0;
+	id->events = 0;
+	if (!input_htable_add(&illum->inputs, id)) {
+		r = -ENOMEM;
+		goto e_libevdev;
+	}
+
+	ev_io_init(&id->w, id->dev ? evdev_cb : activity_cb, ifd, EV_READ);
+	ev_io_start(EV_A_ &id->w);
+
+	pr_info("using %s ("DEVNUM_FMT") as an input dev%s\n", path,
+			DEVNUM_EXP(devnum), id->dev ? "" : " (activity only)");
+
+	return 1;
+e_libevdev:
+	libevdev_free(id->dev);
+e_malloc:
+	free(id);
+e_close:
+	close(ifd);
+	return r;
+}
+
+int illum_replay_add(struct illum *illum, int fd, dev_t devnum EV_P__)
+{
+	int fl = fcntl(fd, F_GETFL);
+	if (fl == -1 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1)
+		return -errno;
+
+	struct input_dev *id = malloc(sizeof(*id));
+	if (!id)
+		return -ENOMEM;
+
+	id->dev = NULL;
+	id->mono = true;
+	id->devnum = devnum;
+	id->parent = illum;
+	id->held = 0;
+	id->mod_keys = 0;
+	id->mods = 0;
+	id->wakeups = 0;
+	id->events = 0;
+	if (!input_htable_add(&illum->inputs, id)) {
+		free(id);
+		return -ENOMEM;
+	}
+
+	ev_io_init(&id->w, replay_cb, fd, EV_READ);
+	ev_io_start(EV_A_ &id->w);
+	return 0;
+}
+
+/*
+ * A device only watched for activity may have keys bound since it was
+ * opened (see illum_reconf()): probe it on the fd it already has.
+ *
+ * Returns 1 if it is now a key device too, 0 if it still isn't, or negative
+ * on error.
+ */
+static int
+input_dev_attach_keys(struct input_dev *id EV_P__)
+{
+	struct illum *illum = id->parent;
+	int ifd = id->w.fd;
+
+	illum->stats.input_probes++;
+	int r = libevdev_new_from_fd(ifd, &id->dev);
+	if (r) {
+		id->dev = NULL;
+		return r;
+	}
+
+	if (!input_dev_has_keys(id->dev, &illum->conf.keymap)) {
+		libevdev_free(id->dev);
+		id->dev = NULL;
+		return 0;
+	}
+
+	id->mono = !libevdev_set_clock_id(id->dev, CLOCK_MONOTONIC);
+	input_dev_mask_events(ifd, illum->conf.idle_timeout > 0, &illum->conf.keymap);
+
+	ev_io_stop(EV_A_ &id->w);
+	ev_set_cb(&id->w, evdev_cb);
+	ev_io_start(EV_A_ &id->w);
+
+	pr_info("using input "DEVNUM_FMT" for keys too\n", DEVNUM_EXP(id->devnum));
+	return 1;
+}
+
+/* tracked, but only for activity, so a key binding may still make it more */
+static bool
+input_dev_activity_only(const struct input_dev *id)
+{
+	return !id->dev && ev_cb(&id->w) == activity_cb;
+}
+
+/*
+ * Test @bit in a sysfs input capability bitmap (like capabilities/key), which
+ * is a list of hex longs, most significant first.
+ */
+static bool
+input_caps_test(const char *caps, unsigned bit)
+{
+	const char *words[BITS_TO_LONGS(KEY_CNT)];
+	size_t n = 0;
+	const char *p = caps;
+
+	for (;;) {
+		while (*p == ' ')
+			p++;
+		if (!*p || *p == '\n')
+			break;
+		if (n == ARRAY_SIZE(words))
+			return false;
+		words[n++] = p;
+		while (*p && *p != ' ' && *p != '\n')
+			p++;
+	}
+
+	size_t w = bit / BITS_PER_LONG;
+	if (w >= n)
+		return false;
+
+	unsigned long v = strtoul(words[n - 1 - w], NULL, 16);
+	return v & (1UL << (bit % BITS_PER_LONG));
+}
+
+/* inputN has no node, and mouseN/jsN duplicate an eventN */
+static bool
+input_dev_is_event(const char *syspath)
+{
+	const char *sysname = strrchr(syspath, '/');
+	return sysname && strstarts(sysname + 1, "event");
+}
+
+/*
+ * Decide if an input device is worth opening based only on what udev and
+ * sysfs already know about it, so the common case (no brightness keys, no
+ * idle dimming) costs no open() or ioctl()s on the device itself.
+ */
+static int
+input_dev_consider(struct illum *illum, const struct illum_dev *d EV_P__)
+{
+	illum->stats.input_seen++;
+
+	if (!input_dev_is_event(d->syspath))
+		return 0;
+
+	if (!d->devnode || !d->devnum) {
+		pr_debug("device node for %s does not exist\n", d->syspath);
+		return 0;
+	}
+
+	struct input_dev *id = input_htable_get(&illum->inputs, &d->devnum);
+	if (id && !input_dev_activity_only(id)) {
+		pr_info("input %s was added but already is tracked, ignoring\n", d->syspath);
+		return 0;
+	}
+
+	/*
+	 * Without udev's input_id data (ID_INPUT unset) we can't trust the
+	 * properties to be complete, so only use them when present.
+	 */
+	if (!d->id_input)
+		return 0;
+
+	bool keys = d->id_input < 0 || d->id_key == 1;
+	if (keys) {
+		/* the key bitmap of the inputN this eventN belongs to */
+		char path[PATH_MAX], caps[512];
+		snprintf(path, sizeof(path), "%s/device/capabilities/key", d->syspath);
+		if (attr_read_str_at(AT_FDCWD, path, caps, sizeof(caps)) >= 0) {
+			const struct keymap *km = &illum->conf.keymap;
+			size_t i;
+			for (i = 0; i < km->key_ct; i++)
+				if (input_caps_test(caps, km->keys[i]))
+					break;
+			keys = i < km->key_ct;
+		}
+	}
+
+	if (id)
+		return keys ? input_dev_attach_keys(id EV_A__) : 0;
+
+	int r = input_dev_new(illum, d->devnode, d->devnum, keys EV_A__);
+	if (r < 0)
+		pr_warn("failed to add new input %s: %d\n", d->syspath, r);
+	return r;
+}
+
+static void
+input_pending__delete(struct illum *illum, struct input_pending *ip)
+{
+	input_pending_htable_del(&illum->pending, ip);
+	tlist2_del_from(&illum->pending_list, ip);
+	free(ip->syspath);
+	free(ip->devnode);
+	free(ip);
+}
+
+static int
+input_pending_set(struct input_pending *ip, const struct illum_dev *d)
+{
+	char *syspath = strdup(d->syspath);
+	char *devnode = d->devnode ? strdup(d->devnode) : NULL;
+	if (!syspath || (d->devnode && !devnode)) {
+		free(syspath);
+		free(devnode);
+		return -ENOMEM;
+	}
+
+	free(ip->syspath);
+	free(ip->devnode);
+	ip->syspath = syspath;
+	ip->devnode = devnode;
+	ip->id_input = d->id_input;
+	ip->id_key = d->id_key;
+	return 0;
+}
+
+/*
+ * Probing runs from an ev_idle watcher at the lowest priority, so it only
+ * gets to run once every other pending event (including input on devices we
+ * already have) has been handled, and then only for PROBE_BATCH devices
+ * before checking again.
+ */
+#define PROBE_BATCH 4
+
+static void
+illum_probe_cb(EV_P_ ev_idle *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_probe);
+	wake_note(EV_A_ WAKE_PROBE);
+	unsigned i;
+	for (i = 0; i < PROBE_BATCH; i++) {
+		struct input_pending *ip = tlist2_top(&illum->pending_list);
+		if (!ip) {
+			pr_debug("probe: queue drained, %ju inputs opened\n",
+					illum->stats.input_opens);
+			ev_idle_stop(EV_A_ w);
+			return;
+		}
+
+		struct illum_dev d = {
+			.action = ILLUM_DEV_ADD,
+			.kind = ILLUM_DEV_INPUT,
+			.syspath = ip->syspath,
+			.devnode = ip->devnode,
+			.devnum = ip->devnum,
+			.id_input = ip->id_input,
+			.id_key = ip->id_key,
+		};
+		input_dev_consider(illum, &d EV_A__);
+		input_pending__delete(illum, ip);
+	}
+}
+
+/*
+ * Hotplug intake: record an added input device for probing later. Only
+ * checks that are free (no I/O) happen here.
+ */
+static void
+input_dev_enqueue(struct illum *illum, const struct illum_dev *d EV_P__)
+{
+	if (!d->devnum || !input_dev_is_event(d->syspath))
+		return;
+
+	struct input_pending *ip = input_pending_htable_get(&illum->pending, &d->devnum);
+	if (ip) {
+		/* the newest description wins */
+		if (input_pending_set(ip, d))
+			pr_warn("input "DEVNUM_FMT": out of memory updating probe\n",
+					DEVNUM_EXP(d->devnum));
+		return;
+	}
+
+	ip = malloc(sizeof(*ip));
+	if (!ip)
+		goto e_nomem;
+
+	ip->devnum = d->devnum;
+	ip->syspath = NULL;
+	ip->devnode = NULL;
+	if (input_pending_set(ip, d)) {
+		free(ip);
+		goto e_nomem;
+	}
+
+	if (!input_pending_htable_add(&illum->pending, ip)) {
+		free(ip->syspath);
+		free(ip->devnode);
+		free(ip);
+		goto e_nomem;
+	}
+
+	tlist2_add_tail(&illum->pending_list, ip);
+	illum->stats.input_queued++;
+
+	if (!ev_is_active(&illum->w_probe))
+		ev_idle_start(EV_A_ &illum->w_probe);
+	return;
+
+e_nomem:
+	pr_warn("input "DEVNUM_FMT": out of memory queuing probe\n",
+			DEVNUM_EXP(d->devnum));
+}
+
+/*
+ * Hotplug intake for removals. An add that hasn't been probed yet is simply
+ * forgotten; removing a tracked device only closes it, so it happens now.
+ */
+static void
+input_dev_dequeue(struct illum *illum, const struct illum_dev *d EV_P__)
+{
+	if (!d->devnum)
+		return;
+
+	struct input_pending *ip = input_pending_htable_get(&illum->pending, &d->devnum);
+	if (ip) {
+		illum->stats.input_collapsed++;
+		input_pending__delete(illum, ip);
+	}
+
+	struct input_dev *id = input_htable_get(&illum->inputs, &d->devnum);
+	if (id)
+		input_dev__delete(id EV_A__);
+}
+
+static struct sys_backlight *
+backlight_find(struct illum *illum, const char *path)
+{
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		if (streq(path, bl->path))
+			return bl;
+	}
+
+	return NULL;
+}
+
+void illum_dev_found(struct illum *illum, const struct illum_dev *d EV_P__)
+{
+	/*
+	 * Probed in the background, like hotplugged ones, once we're ready.
+	 * Ones we have open already come up again in a rescan.
+	 */
+	if (d->kind == ILLUM_DEV_INPUT) {
+		struct input_dev *id = input_htable_get(&illum->inputs, &d->devnum);
+		if (!id || input_dev_activity_only(id))
+			input_dev_enqueue(illum, d EV_A__);
+		return;
+	}
+
+	if (backlight_find(illum, d->syspath))
+		return;
+
+	int r = illum_backlight_add(illum, d->syspath);
+	if (r < 0)
+		fprintf(stderr, "failed to initialize sys backlight at '%s' (%d)\n",
+				d->syspath, r);
+}
+
+void illum_dev_event(struct illum *illum, const struct illum_dev *d EV_P__)
+{
+	if (d->kind == ILLUM_DEV_INPUT) {
+		if (d->action == ILLUM_DEV_ADD)
+			input_dev_enqueue(illum, d EV_A__);
+		else if (d->action == ILLUM_DEV_REMOVE)
+			input_dev_dequeue(illum, d EV_A__);
+		return;
+	}
+
+	struct sys_backlight *bl = backlight_find(illum, d->syspath);
+	int r;
+	switch (d->action) {
+	case ILLUM_DEV_ADD:
+		if (bl) {
+			pr_info("backlight %s was added but already is tracked, ignoring\n",
+					d->syspath);
+			break;
+		}
+
+		r = illum_backlight_add(illum, d->syspath);
+		if (r < 0)
+			pr_warn("failed to add new backlight %s: %d\n", d->syspath, r);
+		break;
+	case ILLUM_DEV_REMOVE:
+		if (bl) {
+			sys_backlight__delete(bl);
+			backlights_select(illum);
+		}
+		break;
+	case ILLUM_DEV_CHANGE:
+		/*
+		 * The backlight class emits these for every brightness
+		 * change, including our own writes (which sync() will see as
+		 * a no-op) and ones made by firmware hotkeys or other
+		 * programs.
+		 */
+		if (bl) {
+			r = sys_backlight_brightness_sync(bl);
+			if (r < 0)
+				pr_warn("failed to sync backlight %s: %d\n", d->syspath, r);
+		}
+		break;
+	}
+}
+
+/*
+ * Control socket, see ctl-proto.h for the protocol.
+ *
+ * Requests are handled as soon as a complete line has been read, and the
+ * responses written straight back (normally in the same wakeup). They are
+ * only kept in ctl_client.out if the socket is full; while out can't fit
+ * another response we stop reading, so a client that pipelines requests
+ * faster than it reads the responses is slowed down rather than growing our
+ * buffers.
+ */
+static uint32_t
+ctl_permille_to_pos(long permille)
+{
+	return DIV_ROUND_CLOSEST((uint64_t)permille * CURVE_POS_ONE,
+			(uint64_t)ILLUM_CTL_PERMILLE);
+}
+
+static long
+ctl_pos_to_permille(uint32_t pos)
+{
+	return DIV_ROUND_CLOSEST((uint64_t)pos * ILLUM_CTL_PERMILLE,
+			(uint64_t)CURVE_POS_ONE);
+}
+
+static bool
+ctl_match(const struct sys_backlight *bl, const char *name)
+{
+	/* backlights not selected can still be named explicitly */
+	return streq(name, "*") ? bl->active : streq(name, bl->name);
+}
+
+static struct sys_backlight *
+ctl_find(struct illum *illum, const char *name)
+{
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		if (ctl_match(bl, name))
+			return bl;
+	}
+
+	return NULL;
+}
+
+static int
+ctl_parse_permille(const char *arg, long min, long *res)
+{
+	char *end;
+	errno = 0;
+	long x = strtol(arg, &end, 10);
+	if (errno || end == arg || *end || x < min || x > ILLUM_CTL_PERMILLE)
+		return -1;
+
+	*res = x;
+	return 0;
+}
+
+/*
+ * Set (or with @rel, step) every backlight matching @name. An explicit
+ * request wins over idle dimming, the same way a change made by something
+ * else does in sys_backlight_brightness_sync().
+ *
+ * Returns the number of backlights matched.
+ */
+static unsigned
+ctl_apply(struct illum *illum, const char *name, bool rel, long permille EV_P__)
+{
+	ev_tstamp now = ev_now(EV_A);
+	bool fading = false;
+	bool learn = illum->als.on;
+	unsigned ct = 0;
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		if (!ctl_match(bl, name))
+			continue;
+
+		int r;
+		ct++;
+		bl->dimmed = false;
+		if (rel) {
+			int32_t mod = ctl_permille_to_pos(labs(permille));
+			r = sys_backlight_brightness_mod(bl, permille < 0 ? -mod : mod,
+					&illum->conf, now);
+		} else {
+			uint32_t pos = ctl_permille_to_pos(permille);
+			r = sys_backlight_retarget(bl, pos, pos > bl->pos ?
+					illum->conf.fade_up : illum->conf.fade_down, now);
+		}
+
+		if (r < 0)
+			pr_warn("ctl: failed to set %s: %d\n", bl->path, r);
+		else if (r)
+			fading = true;
+
+		/* an explicit setting teaches auto-brightness like keys do */
+		if (learn && bl->active) {
+			illum__als_learn(illum, bl->target);
+			learn = false;
+		}
+	}
+
+	if (fading)
+		illum__fade_start(illum EV_A__);
+
+	return ct;
+}
+
+/*
+ * Subscriptions
+ *
+ * While anyone is subscribed, ctl_notify_cb() runs once per loop iteration
+ * and compares each backlight against what was last announced, so changes
+ * from any source (keys, fades, idle dimming, other programs, other clients)
+ * are picked up without hooks in each of them, and a backlight that changed
+ * many times in one iteration is announced once.
+ *
+ * A change formats the ev line once (in the backlight) and bumps
+ * illum.sub_seq. Clients only record the sub_seq they are up to, so sending
+ * a client everything it is missing is copying the lines of the backlights
+ * with a newer sub_seq, and the most that can ever be queued for a client is
+ * one line per backlight no matter how far behind it is.
+ */
+static bool
+ctl_sub_scan(struct illum *illum)
+{
+	bool changed = false;
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		long p = ctl_pos_to_permille(bl->pos);
+		if (p == bl->sub_permille)
+			continue;
+
+		bl->sub_permille = p;
+		bl->sub_seq = ++illum->sub_seq;
+		/* names are at most NAME_MAX, keep the line within LINE_MAX */
+		bl->sub_line_len = snprintf(bl->sub_line, sizeof(bl->sub_line),
+				"ev %.240s %ld\n", bl->name, p);
+		illum->stats.ctl_changes++;
+		changed = true;
+	}
+
+	return changed;
+}
+
+static void
+ctl_client_subscribe(struct ctl_client *cc, ev_tstamp interval EV_P__)
+{
+	struct illum *illum = cc->parent;
+
+	cc->sub_interval = interval;
+	if (cc->sub)
+		return;
+
+	/* the values were not being tracked without subscribers */
+	if (tlist2_empty(&illum->subs)) {
+		ctl_sub_scan(illum);
+		ev_prepare_start(EV_A_ &illum->w_notify);
+	}
+
+	/* a zero sub_seq gets it every backlight, see ctl_client_cb() */
+	cc->sub = true;
+	cc->sub_seq = 0;
+	cc->sub_next = 0;
+	tlist2_add_tail(&illum->subs, cc);
+}
+
+static void
+ctl_client_unsubscribe(struct ctl_client *cc EV_P__)
+{
+	struct illum *illum = cc->parent;
+	if (!cc->sub)
+		return;
+
+	cc->sub = false;
+	tlist2_del_from(&illum->subs, cc);
+	if (tlist2_empty(&illum->subs)) {
+		ev_prepare_stop(EV_A_ &illum->w_notify);
+		ev_timer_stop(EV_A_ &illum->w_sub);
+	}
+}
+
+#define CTL_ARGS_MAX 3
+
+/*
+ * Handle one request @line (without its newline), writing the response
+ * (with its newline) to @resp, which has room for ILLUM_CTL_LINE_MAX bytes.
+ *
+ * Returns the length of the response.
+ */
+static size_t
+ctl_handle(struct ctl_client *cc, char *line, char *resp EV_P__)
+{
+	struct illum *illum = cc->parent;
+	char *argv[CTL_ARGS_MAX + 1];
+	size_t argc = 0;
+	char *save, *tok;
+	const size_t sz = ILLUM_CTL_LINE_MAX;
+	int l;
+
+	illum->stats.ctl_requests++;
+
+	for (tok = strtok_r(line, " \t\r", &save); tok;
+			tok = strtok_r(NULL, " \t\r", &save)) {
+		if (argc == ARRAY_SIZE(argv))
+			return snprintf(resp, sz, "err too many arguments\n");
+		argv[argc++] = tok;
+	}
+
+	if (!argc)
+		return snprintf(resp, sz, "err empty request\n");
+
+	const char *cmd = argv[0];
+	if (streq(cmd, "list")) {
+		if (argc != 1)
+			return snprintf(resp, sz, "err usage: list\n");
+
+		size_t len = snprintf(resp, sz, "ok");
+		struct sys_backlight *bl;
+		tlist2_for_each(&illum->backlights, bl) {
+			size_t n = strlen(bl->name);
+			/* leave room for the newline */
+			if (len + 1 + n + 1 >= sz)
+				break;
+			resp[len++] = ' ';
+			memcpy(resp + len, bl->name, n);
+			len += n;
+		}
+
+		resp[len++] = '\n';
+		return len;
+	}
+
+	if (streq(cmd, "get") || streq(cmd, "raw")) {
+		if (argc > 2)
+			return snprintf(resp, sz, "err usage: %s [<backlight>]\n", cmd);
+
+		struct sys_backlight *bl = ctl_find(illum, argc > 1 ? argv[1] : "*");
+		if (!bl)
+			return snprintf(resp, sz, "err no such backlight\n");
+
+		if (cmd[0] == 'g')
+			l = snprintf(resp, sz, "ok %ld\n", ctl_pos_to_permille(bl->target));
+		else
+			l = snprintf(resp, sz, "ok %"PRIu32" %ju\n", bl->raw,
+					bl->max_brightness);
+		return l;
+	}
+
+	bool rel = streq(cmd, "step");
+	if (rel || streq(cmd, "set")) {
+		if (argc < 2 || argc > 3)
+			return snprintf(resp, sz, "err usage: %s [<backlight>] <%spermille>\n",
+					cmd, rel ? "+-" : "");
+
+		long permille;
+		if (ctl_parse_permille(argv[argc - 1], rel ? -ILLUM_CTL_PERMILLE : 0,
+					&permille))
+			return snprintf(resp, sz, "err bad value '%s'\n", argv[argc - 1]);
+
+		if (!ctl_apply(illum, argc > 2 ? argv[1] : "*", rel, permille EV_A__))
+			return snprintf(resp, sz, "err no such backlight\n");
+
+		return snprintf(resp, sz, "ok\n");
+	}
+
+	if (streq(cmd, "stats")) {
+		if (argc != 1)
+			return snprintf(resp, sz, "err usage: stats\n");
+
+		const struct wake_acct *wa = &illum->wake;
+		size_t len = snprintf(resp, sz, "ok %ju %ju", wa->wakeups,
+				(uintmax_t)wa->cpu_ns / 1000);
+		unsigned s;
+		for (s = 0; s < WAKE_SRC_CT; s++) {
+			const struct wake_stat *ws = &wa->src[s];
+			char item[64];
+			if (!ws->calls && !ws->wakeups)
+				continue;
+
+			int n = snprintf(item, sizeof(item), " %s=%ju/%ju/%ju",
+					wake_src_names[s], ws->wakeups, ws->calls,
+					(uintmax_t)ws->cpu_ns / 1000);
+			/* leave room for the newline */
+			if (len + n + 1 >= sz)
+				break;
+			memcpy(resp + len, item, n);
+			len += n;
+		}
+
+		resp[len++] = '\n';
+		return len;
+	}
+
+	if (streq(cmd, "sub")) {
+		unsigned long ms = ILLUM_CTL_SUB_INTERVAL_MS;
+		char *end;
+		if (argc > 2)
+			return snprintf(resp, sz, "err usage: sub [<msec>]\n");
+		if (argc > 1) {
+			errno = 0;
+			ms = strtoul(argv[1], &end, 10);
+			if (errno || end == argv[1] || *end || *argv[1] == '-' || ms > 60000)
+				return snprintf(resp, sz, "err bad interval '%s'\n", argv[1]);
+		}
+
+		ctl_client_subscribe(cc, ms / 1000. EV_A__);
+		return snprintf(resp, sz, "ok\n");
+	}
+
+	if (streq(cmd, "unsub")) {
+		if (argc != 1)
+			return snprintf(resp, sz, "err usage: unsub\n");
+
+		ctl_client_unsubscribe(cc EV_A__);
+		return snprintf(resp, sz, "ok\n");
+	}
+
+	/* cmd is bounded by the line length */
+	return snprintf(resp, sz, "err unknown command '%.*s'\n", 64, cmd);
+}
+
+/*
+ * The accept callbacks stop listening once out of fds (or libev would call
+ * them again right away), and any client going away frees one.
+ */
+static void
+illum__listen_resume(struct illum *illum EV_P__)
+{
+	if (illum->w_ctl.fd != -1 && !ev_is_active(&illum->w_ctl))
+		ev_io_start(EV_A_ &illum->w_ctl);
+	if (illum->w_inhibit.fd != -1 && !ev_is_active(&illum->w_inhibit))
+		ev_io_start(EV_A_ &illum->w_inhibit);
+}
+
+static void
+ctl_client__delete(struct ctl_client *cc EV_P__)
+{
+	struct illum *illum = cc->parent;
+
+	ctl_client_unsubscribe(cc EV_A__);
+	tlist2_del_from(&illum->ctl_clients, cc);
+	ev_io_stop(EV_A_ &cc->w);
+	close(cc->w.fd);
+	free(cc);
+
+	illum__listen_resume(illum EV_A__);
+}
+
+/* handle every complete line in cc->in that we have room to respond to */
+static void
+ctl_client_process(struct ctl_client *cc EV_P__)
+{
+	char *p = cc->in, *end = cc->in + cc->in_len;
+
+	while (sizeof(cc->out) - cc->out_len >= ILLUM_CTL_LINE_MAX) {
+		char *nl = memchr(p, '\n', end - p);
+		if (!nl) {
+			if (end - p < ILLUM_CTL_LINE_MAX)
+				break;
+
+			/* no way to resync, respond and hang up */
+			cc->out_len += snprintf(cc->out + cc->out_len,
+					ILLUM_CTL_LINE_MAX, "err line too long\n");
+			cc->eof = true;
+			p = end;
+			break;
+		}
+
+		*nl = '\0';
+		cc->out_len += ctl_handle(cc, p, cc->out + cc->out_len EV_A__);
+		p = nl + 1;
+	}
+
+	cc->in_len = end - p;
+	memmove(cc->in, p, cc->in_len);
+}
+
+/* Returns 0 once out is empty, 1 if it is still waiting, or negative errno */
+static int
+ctl_client_flush(struct ctl_client *cc)
+{
+	size_t off = 0;
+	int r = 0;
+
+	while (off < cc->out_len) {
+		ssize_t w = send(cc->w.fd, cc->out + off, cc->out_len - off,
+				MSG_NOSIGNAL);
+		if (w >= 0) {
+			off += w;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+		r = errno == EAGAIN ? 1 : -errno;
+		break;
+	}
+
+	cc->out_len -= off;
+	memmove(cc->out, cc->out + off, cc->out_len);
+	return r;
+}
+
+/*
+ * Write out what we can, and wait for whatever else the client needs.
+ * Returns negative if the client should be closed.
+ */
+static int
+ctl_client_kick(struct ctl_client *cc EV_P__)
+{
+	int r = ctl_client_flush(cc);
+	if (r < 0)
+		return r;
+
+	/* lines left in in are waiting for room in out */
+	int events = 0;
+	if (!cc->eof && sizeof(cc->out) - cc->out_len >= ILLUM_CTL_LINE_MAX)
+		events |= EV_READ;
+	if (cc->out_len)
+		events |= EV_WRITE;
+	if (!events)
+		return -EPIPE;
+
+	if (events != cc->w.events) {
+		ev_io_stop(EV_A_ &cc->w);
+		ev_io_set(&cc->w, cc->w.fd, events);
+		ev_io_start(EV_A_ &cc->w);
+	}
+
+	return 0;
+}
+
+enum ctl_push {
+	CTL_PUSH_NONE,	/* already up to date */
+	CTL_PUSH_SENT,	/* queued in out */
+	CTL_PUSH_LATER,	/* rate limited until sub_next */
+	CTL_PUSH_FULL,	/* no room in out, retried once it drains */
+};
+
+/* Queue whatever @cc is missing, if its rate limit and buffer allow */
+static enum ctl_push
+ctl_client_push(struct ctl_client *cc, ev_tstamp now)
+{
+	struct illum *illum = cc->parent;
+	struct sys_backlight *bl;
+
+	if (!cc->sub || cc->sub_seq == illum->sub_seq)
+		return CTL_PUSH_NONE;
+	if (now < cc->sub_next)
+		return CTL_PUSH_LATER;
+
+	size_t need = 0;
+	tlist2_for_each(&illum->backlights, bl) {
+		if (bl->sub_seq > cc->sub_seq)
+			need += bl->sub_line_len;
+	}
+
+	/* all or nothing, so sub_seq alone says what it has seen */
+	if (need > sizeof(cc->out) - cc->out_len)
+		return CTL_PUSH_FULL;
+
+	tlist2_for_each(&illum->backlights, bl) {
+		if (bl->sub_seq <= cc->sub_seq)
+			continue;
+		memcpy(cc->out + cc->out_len, bl->sub_line, bl->sub_line_len);
+		cc->out_len += bl->sub_line_len;
+	}
+
+	cc->sub_seq = illum->sub_seq;
+	cc->sub_next = now + cc->sub_interval;
+	illum->stats.ctl_pushes++;
+	return CTL_PUSH_SENT;
+}
+
+/* fan out to every subscriber, and arm w_sub for the rate limited ones */
+static void
+ctl_subs_push(struct illum *illum EV_P__)
+{
+	ev_tstamp now = ev_now(EV_A), next = 0;
+	struct ctl_client *cc, *tmp;
+
+	tlist2_for_each_safe(&illum->subs, cc, tmp) {
+		switch (ctl_client_push(cc, now)) {
+		case CTL_PUSH_SENT:
+			if (ctl_client_kick(cc EV_A__) < 0)
+				ctl_client__delete(cc EV_A__);
+			break;
+		case CTL_PUSH_LATER:
+			if (!next || cc->sub_next < next)
+				next = cc->sub_next;
+			break;
+		case CTL_PUSH_NONE:
+		case CTL_PUSH_FULL:
+			break;
+		}
+	}
+
+	ev_timer_stop(EV_A_ &illum->w_sub);
+	if (next) {
+		ev_timer_set(&illum->w_sub, next - now, 0.);
+		ev_timer_start(EV_A_ &illum->w_sub);
+	}
+}
+
+static void
+ctl_notify_cb(EV_P_ ev_prepare *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_notify);
+	wake_note(EV_A_ WAKE_SUB);
+	if (ctl_sub_scan(illum))
+		ctl_subs_push(illum EV_A__);
+}
+
+static void
+ctl_sub_cb(EV_P_ ev_timer *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_sub);
+	wake_note(EV_A_ WAKE_SUB);
+	ctl_subs_push(illum EV_A__);
+}
+
+static void
+ctl_client_cb(EV_P_ ev_io *w, int revents)
+{
+	struct ctl_client *cc = container_of(w, struct ctl_client, w);
+	wake_note(EV_A_ WAKE_CTL);
+
+	if (revents & EV_READ) {
+		ssize_t r = read(w->fd, cc->in + cc->in_len,
+				sizeof(cc->in) - cc->in_len);
+		if (r > 0) {
+			cc->in_len += r;
+		} else if (!r) {
+			/* a last request without its newline still counts */
+			if (cc->in_len && cc->in_len < sizeof(cc->in)
+					&& cc->in[cc->in_len - 1] != '\n')
+				cc->in[cc->in_len++] = '\n';
+			cc->eof = true;
+		} else if (errno != EAGAIN && errno != EINTR) {
+			goto close;
+		}
+	}
+
+	ctl_client_process(cc EV_A__);
+
+	/*
+	 * New subscribers, and ones that had fallen behind and now have room
+	 * again. Rate limited ones are left to w_sub.
+	 */
+	ctl_client_push(cc, ev_now(EV_A));
+
+	if (ctl_client_kick(cc EV_A__) < 0)
+		goto close;
+	return;
+
+close:
+	ctl_client__delete(cc EV_A__);
+}
+
+static void
+ctl_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_ctl);
+	wake_note(EV_A_ WAKE_CTL);
+	for (;;) {
+		int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				/* until a client goes away, or we'd spin */
+				pr_warn("ctl: out of fds, not accepting more\n");
+				ev_io_stop(EV_A_ w);
+			} else if (errno != EAGAIN) {
+				pr_warn("ctl: accept failed: %s\n", strerror(errno));
+			}
+			return;
+		}
+
+		struct ctl_client *cc = malloc(sizeof(*cc));
+		if (!cc) {
+			close(fd);
+			continue;
+		}
+
+		cc->parent = illum;
+		cc->eof = false;
+		cc->sub = false;
+		cc->in_len = 0;
+		cc->out_len = 0;
+		tlist2_add_tail(&illum->ctl_clients, cc);
+		illum->stats.ctl_clients++;
+
+		ev_io_init(&cc->w, ctl_client_cb, fd, EV_READ);
+		ev_io_start(EV_A_ &cc->w);
+	}
+}
+
+/*
+ * Connecting needs write permission on the socket, and clients (status bars,
+ * video players, illum-ctl) run as the user: the same mode systemd gives
+ * sockets it creates, whatever our umask.
+ */
+#define ILLUM_SOCK_MODE 0666
+
+/*
+ * Returns a listening socket bound to @path, or negative errno. A socket
+ * left behind at @path (by an earlier illum-d) is replaced.
+ */
+static int
+ctl_listen(const char *path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(sa.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1
+			|| chmod(path, ILLUM_SOCK_MODE) == -1
+			|| listen(fd, SOMAXCONN) == -1) {
+		int e = -errno;
+		close(fd);
+		return e;
+	}
+
+	return fd;
+}
+
+/*
+ * Inhibit socket, see ctl-proto.h
+ *
+ * Taking or dropping an inhibit only touches a counter, and idle dimming is
+ * stopped outright while any are held, so holders cost nothing until they
+ * hang up.
+ */
+static void
+inhibit_get(struct illum *illum, enum inhibit mode EV_P__)
+{
+	bool was = illum__inhibited(illum, INHIBIT_DIM);
+
+	illum->inhibit_ct[mode]++;
+	if (was || illum->conf.idle_timeout <= 0)
+		return;
+
+	pr_debug("inhibit: idle dimming inhibited\n");
+	if (illum->dimmed)
+		illum__undim(illum EV_A__);
+	ev_timer_stop(EV_A_ &illum->w_idle);
+}
+
+static void
+inhibit_put(struct illum *illum, enum inhibit mode EV_P__)
+{
+	illum->inhibit_ct[mode]--;
+	if (illum__inhibited(illum, INHIBIT_DIM) || illum->conf.idle_timeout <= 0)
+		return;
+
+	/* the full timeout starts over from the release */
+	pr_debug("inhibit: idle dimming allowed\n");
+	illum__idle_start(illum EV_A__);
+}
+
+static void
+inhibitor__delete(struct inhibitor *ih EV_P__)
+{
+	struct illum *illum = ih->parent;
+
+	inhibit_put(illum, ih->mode EV_A__);
+	ev_io_stop(EV_A_ &ih->w);
+	close(ih->w.fd);
+	free(ih);
+
+	illum__listen_resume(illum EV_A__);
+}
+
+static void
+inhibitor_mode(struct inhibitor *ih EV_P__)
+{
+	unsigned i;
+	for (i = 0; i < INHIBIT_CT; i++) {
+		if (streq(ih->line, inhibit_names[i]))
+			break;
+	}
+
+	if (i == INHIBIT_CT) {
+		pr_debug("inhibit: unknown mode '%s', using %s\n", ih->line,
+				inhibit_names[ih->mode]);
+		return;
+	}
+
+	/* get first, so dimming isn't restarted in between */
+	inhibit_get(ih->parent, i EV_A__);
+	inhibit_put(ih->parent, ih->mode EV_A__);
+	ih->mode = i;
+}
+
+static void
+inhibitor_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct inhibitor *ih = container_of(w, struct inhibitor, w);
+	wake_note(EV_A_ WAKE_INHIBIT);
+	char buf[64];
+	ssize_t r = read(w->fd, buf, sizeof(buf));
+
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		inhibitor__delete(ih EV_A__);
+		return;
+	}
+
+	ssize_t i;
+	for (i = 0; ih->first && i < r; i++) {
+		if (buf[i] == '\n' || ih->line_len == sizeof(ih->line) - 1) {
+			ih->line[ih->line_len] = '\0';
+			ih->first = false;
+			inhibitor_mode(ih EV_A__);
+			break;
+		}
+		ih->line[ih->line_len++] = buf[i];
+	}
+}
+
+static void
+inhibit_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct illum *illum = container_of(w, struct illum, w_inhibit);
+	wake_note(EV_A_ WAKE_INHIBIT);
+	for (;;) {
+		int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				/* until an inhibitor goes away, or we'd spin */
+				pr_warn("inhibit: out of fds, not accepting more\n");
+				ev_io_stop(EV_A_ w);
+			} else if (errno != EAGAIN) {
+				pr_warn("inhibit: accept failed: %s\n", strerror(errno));
+			}
+			return;
+		}
+
+		struct inhibitor *ih = malloc(sizeof(*ih));
+		if (!ih) {
+			close(fd);
+			continue;
+		}
+
+		ih->parent = illum;
+		ih->mode = INHIBIT_DIM;
+		ih->first = true;
+		ih->line_len = 0;
+		illum->stats.inhibits++;
+		inhibit_get(illum, ih->mode EV_A__);
+
+		ev_io_init(&ih->w, inhibitor_cb, fd, EV_READ);
+		ev_io_start(EV_A_ &ih->w);
+	}
+}
+
+
+int illum_conf_init(struct illum_conf *conf)
+{
+	*conf = (struct illum_conf) {
+		.curve = {
+			.type = CURVE_POWER,
+			.linearity = 2,
+		},
+		.fade_rate = 60,
+		.hold_interval = 0.05,
+		.dim_level = CURVE_POS_PERCENT(10),
+	};
+
+	return keymap_init(&conf->keymap);
+}
+
+void illum_conf_free(struct illum_conf *conf)
+{
+	size_t i;
+	for (i = 0; i < conf->bl_override_ct; i++)
+		free((char *)conf->bl_overrides[i].name);
+	free(conf->bl_overrides);
+	keymap_free(&conf->keymap);
+}
+
+int illum_init(struct illum *illum)
+{
+	*illum = (struct illum) {
+		.record_fd = -1,
+	};
+	input_htable_init(&illum->inputs);
+	input_pending_htable_init(&illum->pending);
+	tlist2_init(&illum->pending_list);
+	tlist2_init(&illum->backlights);
+	tlist2_init(&illum->ctl_clients);
+	tlist2_init(&illum->subs);
+
+	ev_init(&illum->w_fade, illum_fade_cb);
+	ev_init(&illum->w_hold, illum_hold_cb);
+	ev_prepare_init(&illum->w_flush, illum_flush_cb);
+	ev_init(&illum->w_idle, illum_idle_cb);
+	ev_idle_init(&illum->w_probe, illum_probe_cb);
+	ev_set_priority(&illum->w_probe, EV_MINPRI);
+	ev_signal_init(&illum->w_stats, illum_stats_cb, SIGUSR1);
+
+	ev_prepare_init(&illum->w_notify, ctl_notify_cb);
+	/* after w_flush, to announce its steps in the same iteration */
+	ev_set_priority(&illum->w_notify, EV_MINPRI);
+	ev_init(&illum->w_sub, ctl_sub_cb);
+	ev_io_init(&illum->w_ctl, ctl_accept_cb, -1, EV_READ);
+	ev_io_init(&illum->w_inhibit, inhibit_accept_cb, -1, EV_READ);
+
+	return illum_conf_init(&illum->conf);
+}
+
+void illum_start(struct illum *illum EV_P__)
+{
+	wake_attach(&illum->wake EV_A__);
+	ev_signal_start(EV_A_ &illum->w_stats);
+
+	if (illum->conf.idle_timeout > 0)
+		illum__idle_start(illum EV_A__);
+}
+
+static bool
+conf_bl_overrides_eq(const struct illum_conf *a, const struct illum_conf *b)
+{
+	size_t i;
+	if (a->bl_override_ct != b->bl_override_ct)
+		return false;
+
+	for (i = 0; i < a->bl_override_ct; i++)
+		if (a->bl_overrides[i].use != b->bl_overrides[i].use ||
+				!streq(a->bl_overrides[i].name, b->bl_overrides[i].name))
+			return false;
+	return true;
+}
+
+/*
+ * New curve tables for every backlight. Each stays at the raw value it is
+ * at, which is now somewhere else along the curve, rather than jumping to
+ * its old position on the new curve.
+ */
+static void
+illum__recurve(struct illum *illum)
+{
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		struct curve c;
+		if (curve_init(&c, &illum->conf.curve, bl->max_brightness) < 0) {
+			pr_warn("reconf: curve unusable for %s, keeping the old one\n",
+					bl->path);
+			continue;
+		}
+
+		bl->curve = c;
+		bl->target = bl->pos = curve_raw_to_pos(&bl->curve, bl->raw);
+		bl->fade_len = 0;
+		bl->dimmed = false;
+		bl->off = false;
+		sys_backlight_save(bl);
+	}
+}
+
+/*
+ * Bring the open input devices in line with the keymap and whether idle
+ * dimming is on: what the kernel passes on is set again (EVIOCSMASK is
+ * per open file, so nothing queued is lost), and activity-only devices
+ * are only read while dimming is on. They all stay open.
+ */
+static void
+illum__inputs_reconf(struct illum *illum EV_P__)
+{
+	bool activity = illum->conf.idle_timeout > 0;
+	struct input_htable_iter it;
+	struct input_dev *id;
+
+	for (id = input_htable_first(&illum->inputs, &it); id;
+			id = input_htable_next(&illum->inputs, &it)) {
+		if (id->dev) {
+			input_dev_mask_events(id->w.fd, activity, &illum->conf.keymap);
+		} else if (input_dev_activity_only(id)) {
+			if (activity) {
+				input_dev_drain(id);
+				ev_io_start(EV_A_ &id->w);
+			} else {
+				ev_io_stop(EV_A_ &id->w);
+			}
+		}
+	}
+}
+
+void illum_reconf(struct illum *illum, struct illum_conf *conf EV_P__)
+{
+	struct illum_conf old = illum->conf;
+	illum->conf = *conf;
+	conf = &illum->conf;
+
+	bool was_idle = old.idle_timeout > 0, idle = conf->idle_timeout > 0;
+	bool keys = !keymap_keys_eq(&old.keymap, &conf->keymap);
+	bool rescan = false;
+
+	if (old.curve.type != conf->curve.type ||
+			old.curve.linearity != conf->curve.linearity) {
+		pr_info("reconf: %s curve\n", curve_type_name(conf->curve.type));
+		illum__recurve(illum);
+	}
+
+	if (!conf_bl_overrides_eq(&old, conf))
+		backlights_select(illum);
+
+	if (keys || was_idle != idle) {
+		pr_info("reconf: %zu keys bound, idle dimming %s\n",
+				conf->keymap.key_ct, idle ? "on" : "off");
+		illum__inputs_reconf(illum EV_A__);
+
+		/* devices passed over before may be wanted now */
+		rescan = keys || idle;
+	}
+
+	if (!idle && was_idle) {
+		if (illum->dimmed)
+			illum__undim(illum EV_A__);
+		ev_timer_stop(EV_A_ &illum->w_idle);
+	} else if (idle && old.idle_timeout != conf->idle_timeout &&
+			!illum->dimmed && !illum__inhibited(illum, INHIBIT_DIM)) {
+		illum__idle_start(illum EV_A__);
+	}
+
+	if (rescan && illum->rescan)
+		illum->rescan(illum->rescan_src EV_A__);
+
+	illum_conf_free(&old);
+}
+
+/*
+ * not fatal, keys work without either. Sockets passed by the service manager
+ * (named "ctl" and "inhibit", see svc.h) are used instead of the paths.
+ */
+void illum_listen(struct illum *illum, const char *ctl_path,
+		const char *inhibit_path EV_P__)
+{
+	int fd = svc_listen_fd("ctl", "ctl");
+	if (fd < 0 && *ctl_path) {
+		fd = ctl_listen(ctl_path);
+		if (fd < 0)
+			pr_warn("control socket %s: %s\n", ctl_path, strerror(-fd));
+	}
+	if (fd >= 0) {
+		ev_io_set(&illum->w_ctl, fd, EV_READ);
+		ev_io_start(EV_A_ &illum->w_ctl);
+	}
+
+	fd = svc_listen_fd("inhibit", "ctl");
+	if (fd < 0 && *inhibit_path) {
+		fd = ctl_listen(inhibit_path);
+		if (fd < 0)
+			pr_warn("inhibit socket %s: %s\n", inhibit_path, strerror(-fd));
+	}
+	if (fd >= 0) {
+		ev_io_set(&illum->w_inhibit, fd, EV_READ);
+		ev_io_start(EV_A_ &illum->w_inhibit);
+
+		/* every holder is an fd, allow as many as we may */
+		struct rlimit rl;
+		if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+	}
+}
+
+void illum_fini(struct illum *illum EV_P__)
+{
+	struct input_htable_iter it;
+	struct input_dev *id;
+	while ((id = input_htable_first(&illum->inputs, &it)))
+		input_dev__delete(id EV_A__);
+
+	struct sys_backlight *bl, *nxt;
+	tlist2_for_each_safe(&illum->backlights, bl, nxt)
+		sys_backlight__delete(bl);
+
+	illum_conf_free(&illum->conf);
+}
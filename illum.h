@@ -0,0 +1,585 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#ifndef ILLUM_H_
+#define ILLUM_H_
+#pragma once
+
+/*
+ * The daemon's state and the entry points illum-d (main-daemon.c) and
+ * illum-bench (main-bench.c) build on. Everything else in illum.c is
+ * private to it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <linux/input.h>
+
+/* linux/input.h before 4.16 */
+#ifndef input_event_sec
+# define input_event_sec time.tv_sec
+# define input_event_usec time.tv_usec
+#endif
+
+#include "ev-ext.h"
+#include "curve.h"
+#include "latency.h"
+#include "ctl-proto.h"
+#include "state.h"
+#include "keymap.h"
+#include "wake.h"
+
+#include <ccan/tlist2/tlist2.h>
+#include <ccan/htable/htable_type.h>
+
+struct libevdev;
+
+
+/*
+ * Stages an input event goes through on its way to the backlight, each
+ * with a histogram per backlight. See struct lat_stamp.
+ */
+enum lat_stage {
+	LAT_DELIVER,	/* kernel event timestamp -> evdev_cb() */
+	LAT_COMPUTE,	/* evdev_cb() -> raw value posted to the worker */
+	LAT_QUEUE,	/* posted -> the worker starts write() */
+	LAT_WRITE,	/* write() itself, recorded for every write */
+	LAT_TOTAL,	/* kernel event timestamp -> write() returned */
+	LAT_STAGE_CT
+};
+
+/*
+ * The sysfs "type" of a backlight, in order of preference when several
+ * control the same panel. See backlights_select().
+ */
+enum bl_type {
+	BL_UNKNOWN,
+	BL_FIRMWARE,
+	BL_PLATFORM,
+	BL_RAW,
+};
+
+/*
+ * sys_backlight assumes max_brightness is fixed
+ */
+struct sys_backlight {
+	struct list_node list;
+
+	char *path;
+	/* the last component of path, how the control socket refers to us */
+	const char *name;
+	int dir_fd;
+	uintmax_t max_brightness;
+
+	/*
+	 * Which physical panel we think this is (the syspath of the closest
+	 * PCI ancestor, NULL if there is none) and whether we write to it,
+	 * see backlights_select(). Inactive backlights are still tracked so
+	 * one can take over when the active one goes away.
+	 */
+	enum bl_type type;
+	char *panel;
+	bool active;
+
+	/* kept open for the life of the backlight, see attr.h */
+	int brightness_rfd;
+	int brightness_wfd;
+
+	/*
+	 * Shadow state: the last raw value we wrote (or read back) and the
+	 * target position on the curve (with more precision than the raw
+	 * value). Keypresses only touch these and write the result; udev
+	 * change events resync them when something else adjusts the
+	 * backlight.
+	 */
+	uint32_t raw;
+	uint32_t target;
+	struct curve curve;
+
+	/*
+	 * Where on the curve the backlight is right now, which only differs
+	 * from target while fading (fade_len != 0) from fade_from.
+	 */
+	uint32_t pos;
+	uint32_t fade_from;
+	ev_tstamp fade_start;
+	ev_tstamp fade_len;
+	/* the fade was started by the light sensor, see illum_als_stop() */
+	bool als_fade;
+
+	/* set while idle dimmed, to restore undim_target on activity */
+	bool dimmed;
+	uint32_t undim_target;
+
+	/* turned off by a key, to go back to off_target */
+	bool off;
+	uint32_t off_target;
+
+	/* where the level to restore at the next start goes, or NULL */
+	struct state_slot *saved;
+
+	/* the input event behind the current target, until it is posted */
+	struct lat_stamp trace;
+
+	/*
+	 * The last brightness announced to control socket subscribers, the
+	 * ev line announcing it, and illum.sub_seq when it changed. See
+	 * ctl_notify_cb().
+	 */
+	long sub_permille;
+	uint64_t sub_seq;
+	size_t sub_line_len;
+	char sub_line[ILLUM_CTL_LINE_MAX];
+
+	/*
+	 * The writer thread and its single slot mailbox, see
+	 * sys_backlight_worker(). Everything below is protected by lock.
+	 */
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t mbox;
+	struct lat_stamp mbox_stamp;
+	bool mbox_full;
+	/* the worker is in write() */
+	bool inflight;
+	bool stop;
+
+	uintmax_t writes;
+	uintmax_t write_errors;
+	/* values overwritten in the mailbox before the worker got to them */
+	uintmax_t superseded;
+
+	struct lat_hist lat[LAT_STAGE_CT];
+};
+
+/* held step keys are tracked per direction */
+enum hold_key {
+	HOLD_UP,
+	HOLD_DOWN,
+	HOLD_KEY_CT
+};
+
+struct input_dev {
+	/* key in illum->inputs */
+	dev_t devnum;
+
+	struct illum *parent;
+	ev_io w;
+
+	/*
+	 * NULL for devices we only watch for activity (idle dimming), which
+	 * are read directly by activity_cb() without any per-device state,
+	 * and for replayed event streams (see illum_replay_add()).
+	 */
+	struct libevdev *dev;
+
+	/*
+	 * bitmask of (1 << enum hold_key) currently held on this device, and
+	 * the key holding each
+	 */
+	unsigned held;
+	uint16_t hold_code[HOLD_KEY_CT];
+
+	/*
+	 * modifier keys down (bits by index in keymap_mod_keys) and the
+	 * modifier state they make up, for keymap_lookup()
+	 */
+	uint8_t mod_keys;
+	uint8_t mods;
+
+	/* event timestamps are CLOCK_MONOTONIC, so latency can be traced */
+	bool mono;
+
+	/* evdev_cb() calls and events read, logged on SIGUSR1 */
+	uintmax_t wakeups;
+	uintmax_t events;
+};
+
+#define DEVNUM_FMT "%u:%u"
+#define DEVNUM_EXP(d) major(d), minor(d)
+
+static inline const dev_t *
+input_dev_keyof(const struct input_dev *id)
+{
+	return &id->devnum;
+}
+
+static inline size_t
+devnum_hash(const dev_t *d)
+{
+	uint64_t h = (uint64_t)*d * UINT64_C(0x9e3779b97f4a7c15);
+	return h ^ (h >> 32);
+}
+
+static inline bool
+input_dev_eq(const struct input_dev *id, const dev_t *d)
+{
+	return id->devnum == *d;
+}
+
+HTABLE_DEFINE_TYPE(struct input_dev, input_dev_keyof, devnum_hash, input_dev_eq,
+		input_htable);
+
+/*
+ * A device (dis)appearing or changing, as reported by a device source: udev
+ * (udev-src.c) in illum-d, or a script in illum-bench. Sources fill one in
+ * from whatever they know and hand it to illum_dev_event().
+ */
+enum illum_dev_action {
+	ILLUM_DEV_ADD,
+	ILLUM_DEV_REMOVE,
+	ILLUM_DEV_CHANGE,
+};
+
+enum illum_dev_kind {
+	ILLUM_DEV_BACKLIGHT,
+	ILLUM_DEV_INPUT,
+};
+
+struct illum_dev {
+	enum illum_dev_action action;
+	enum illum_dev_kind kind;
+
+	/* the sysfs directory, inputs are only used if it is an event* */
+	const char *syspath;
+
+	/* inputs only: the device node and its number, NULL/0 if none */
+	const char *devnode;
+	dev_t devnum;
+
+	/* inputs only: udev's ID_INPUT and ID_INPUT_KEY, -1 if unknown */
+	signed char id_input;
+	signed char id_key;
+};
+
+/*
+ * An input device a source told us about that hasn't been probed yet, see
+ * input_dev_enqueue(). The newest description of it is kept.
+ */
+struct input_pending {
+	dev_t devnum;
+	struct list_node list;
+
+	char *syspath;
+	char *devnode;
+	signed char id_input;
+	signed char id_key;
+};
+
+static inline const dev_t *
+input_pending_keyof(const struct input_pending *ip)
+{
+	return &ip->devnum;
+}
+
+static inline bool
+input_pending_eq(const struct input_pending *ip, const dev_t *d)
+{
+	return ip->devnum == *d;
+}
+
+HTABLE_DEFINE_TYPE(struct input_pending, input_pending_keyof, devnum_hash,
+		input_pending_eq, input_pending_htable);
+
+/* what a connection to the inhibit socket is holding off, see ctl-proto.h */
+enum inhibit {
+	INHIBIT_DIM,
+	INHIBIT_ALL,
+	INHIBIT_CT
+};
+
+struct inhibitor {
+	struct illum *parent;
+	ev_io w;
+	enum inhibit mode;
+	/* still waiting for the mode line, which is kept in line */
+	bool first;
+	size_t line_len;
+	char line[8];
+};
+
+/*
+ * A connection to the control socket, see ctl-proto.h and ctl_client_cb().
+ */
+#define CTL_BUF_SZ 4096
+
+struct ctl_client {
+	struct list_node list;
+	struct illum *parent;
+	ev_io w;
+
+	/* the client shut down its side, close once out is drained */
+	bool eof;
+
+	/*
+	 * Subscribers are on illum.subs. sub_seq is the illum.sub_seq they
+	 * have been sent everything up to, and sub_next when they may be
+	 * sent more.
+	 */
+	bool sub;
+	struct list_node sub_list;
+	uint64_t sub_seq;
+	ev_tstamp sub_interval;
+	ev_tstamp sub_next;
+
+	size_t in_len;
+	size_t out_len;
+	char in[CTL_BUF_SZ];
+	char out[CTL_BUF_SZ];
+};
+
+struct bl_override {
+	/* the backlight's name, the last component of its path */
+	const char *name;
+	bool use;
+};
+
+struct illum_conf {
+	// maps key steps to raw brightness, see curve.h
+	struct curve_params curve;
+
+	// seconds to fade when brightening and dimming, 0 to jump directly
+	ev_tstamp fade_up, fade_down;
+	// fade frames per second
+	unsigned fade_rate;
+
+	// seconds between steps while a brightness key is held
+	ev_tstamp hold_interval;
+
+	// seconds without input before dimming (0 disables), and the position
+	// to dim to
+	ev_tstamp idle_timeout;
+	uint32_t dim_level;
+
+	// key bindings, see keymap.h
+	struct keymap keymap;
+
+	// backlights named by -b, forced on or off instead of being selected
+	struct bl_override *bl_overrides;
+	size_t bl_override_ct;
+};
+
+/* bands of ambient light levels with their own learned offset */
+#define ALS_BINS 8
+
+struct illum {
+	/* keyed by devnum, so udev add/remove never compares strings */
+	struct input_htable inputs;
+
+	/*
+	 * Hotplugged inputs waiting to be probed by w_probe, in arrival order
+	 * and indexed by devnum.
+	 */
+	struct input_pending_htable pending;
+	TLIST2(struct input_pending, list) pending_list;
+	struct ev_idle w_probe;
+	TLIST2(struct sys_backlight, list) backlights;
+
+	struct ev_timer w_fade;
+	struct illum_conf conf;
+
+	/*
+	 * Held brightness keys, across all input devices. While any are held
+	 * w_hold steps in hold_dir once per conf.hold_interval, with steps
+	 * growing the longer the key has been held (since hold_start) up to the
+	 * step of the key's binding.
+	 */
+	struct ev_timer w_hold;
+	unsigned hold_ct[HOLD_KEY_CT];
+	int32_t hold_step[HOLD_KEY_CT];
+	int hold_dir;
+	ev_tstamp hold_start;
+
+	/* steps from this loop iteration, applied by w_flush */
+	struct ev_prepare w_flush;
+	int64_t pending_mod;
+	/* the first key press behind pending_mod */
+	struct lat_stamp pending_stamp;
+
+	/* idle dimming, see illum_idle_cb() */
+	struct ev_timer w_idle;
+	ev_tstamp last_activity;
+	bool dimmed;
+
+	/* control socket, w_ctl.fd is -1 if disabled */
+	struct ev_io w_ctl;
+	TLIST2(struct ctl_client, list) ctl_clients;
+
+	/*
+	 * Subscribed clients. w_notify watches for brightness changes while
+	 * there are any, and w_sub wakes us for the ones that were rate
+	 * limited.
+	 */
+	TLIST2(struct ctl_client, sub_list) subs;
+	uint64_t sub_seq;
+	struct ev_prepare w_notify;
+	struct ev_timer w_sub;
+
+	/*
+	 * Inhibit socket. Holders are only counted (per mode), each watched by
+	 * its own ev_io for the hangup.
+	 */
+	struct ev_io w_inhibit;
+	unsigned inhibit_ct[INHIBIT_CT];
+
+	/*
+	 * Auto-brightness from an ambient light sensor, only used once a
+	 * source (see illum_als_start()) was set up. Levels are log10(1 +
+	 * lux): level is the smoothed one, applied the one the backlights were
+	 * last moved for, and offset[] what keys taught us on top of the
+	 * default mapping, per band of levels. See illum_als_sample().
+	 */
+	struct {
+		bool on;
+		bool settled;
+		ev_tstamp last;
+		double level;
+		double applied;
+		int32_t offset[ALS_BINS];
+
+		uintmax_t samples;
+		uintmax_t changes;
+		uintmax_t learned;
+	} als;
+
+	/* SIGUSR1 logs these */
+	struct ev_signal w_stats;
+	struct {
+		uintmax_t events;
+		uintmax_t flushes;
+
+		uintmax_t input_seen;
+		uintmax_t input_opens;
+		uintmax_t input_probes;
+		uintmax_t input_queued;
+		uintmax_t input_collapsed;
+
+		uintmax_t ctl_clients;
+		uintmax_t ctl_requests;
+		uintmax_t ctl_changes;
+		uintmax_t ctl_pushes;
+
+		uintmax_t inhibits;
+	} stats;
+
+	/* every wakeup of the loop, by source, once illum_start() ran */
+	struct wake_acct wake;
+
+	/* events from key devices are appended here if not -1, see -R */
+	int record_fd;
+
+	/* backlight levels kept across restarts, or NULL, see state.h */
+	struct state_file *state;
+
+	/*
+	 * Set by the device source: report every present device through
+	 * illum_dev_found() again, see illum_reconf().
+	 */
+	void (*rescan)(void *src EV_P__);
+	void *rescan_src;
+};
+
+extern const char *const lat_stage_names[LAT_STAGE_CT];
+
+/*
+ * Zero @illum and set up the defaults and watchers. Nothing is started: the
+ * caller adjusts illum->conf and adds its sources, then calls illum_start().
+ * Returns 0, or negative if out of memory.
+ */
+int illum_init(struct illum *illum);
+
+/*
+ * Options that set illum->conf, shared by everything built on illum.c.
+ * Returns 0 if @c was handled, 1 if it isn't one of ILLUM_CONF_OPTS, or -1
+ * (after printing why) if @arg is bad.
+ */
+#define ILLUM_CONF_OPTS "l:c:b:f:F:r:H:t:d:k:"
+int illum_conf_opt(struct illum_conf *conf, int c, const char *arg);
+
+/* set @conf to the defaults, returns 0 or negative if out of memory */
+int illum_conf_init(struct illum_conf *conf);
+void illum_conf_free(struct illum_conf *conf);
+
+/*
+ * Switch to @conf (which is taken over), redoing only what depends on the
+ * settings that changed: curve tables, the events asked of open input
+ * devices, backlight selection, the idle timer. Devices stay open
+ * throughout, and if the new keymap or idle dimming may want devices that
+ * were passed over, the device source is asked to rescan.
+ */
+void illum_reconf(struct illum *illum, struct illum_conf *conf EV_P__);
+
+/*
+ * start the idle timer (if configured) and the SIGUSR1 stats handler, and
+ * account the loop's wakeups in illum->wake
+ */
+void illum_start(struct illum *illum EV_P__);
+
+/*
+ * Track the backlight at @path (a directory with brightness and
+ * max_brightness, normally in /sys/class/backlight) and rerun the selection.
+ */
+int illum_backlight_add(struct illum *illum, const char *path);
+
+/*
+ * Device sources report through these: illum_dev_found() for devices that
+ * were already there when it started and illum_dev_event() for hotplug.
+ * Backlights are set up right away, inputs are queued for w_probe either way
+ * so the daemon is usable before they have all been looked at.
+ */
+void illum_dev_found(struct illum *illum, const struct illum_dev *d EV_P__);
+void illum_dev_event(struct illum *illum, const struct illum_dev *d EV_P__);
+
+/*
+ * The udev device source (udev-src.c): scan for backlights and inputs, and
+ * follow hotplug. Returns 0 or the negated exit status for illum-d.
+ */
+int illum_udev_start(struct illum *illum EV_P__);
+
+/*
+ * Feed an ambient light reading, in lux. Sources call this once per wakeup
+ * (with the mean of whatever they read), as the smoothing is timed by
+ * ev_now().
+ */
+void illum_als_sample(struct illum *illum, double lux EV_P__);
+
+/*
+ * The ambient light sensor source (als.c). @path is an IIO device (its
+ * directory in sysfs, or just its name like "iio:device0"), which is read
+ * through its buffer, or else a file or fifo of lux readings, one per line.
+ * Returns 0, or negative after logging why not.
+ */
+int illum_als_start(struct illum *illum, const char *path EV_P__);
+
+/*
+ * The source is gone: keys no longer teach the mapping, and backlights
+ * fading to a reading stop where they are.
+ */
+void illum_als_stop(struct illum *illum EV_P__);
+
+/*
+ * listen on the control and inhibit sockets, '' to skip either. Sockets
+ * passed by the service manager take precedence, see svc.h.
+ */
+void illum_listen(struct illum *illum, const char *ctl_path,
+		const char *inhibit_path EV_P__);
+
+/*
+ * Treat @fd as an input device that produces struct input_event (as read
+ * from /dev/input/event*, or recorded with -R) with CLOCK_MONOTONIC
+ * timestamps. It is removed (and @fd closed) at EOF. @devnum only has to be
+ * unique among inputs, major 0 never clashes with a real one.
+ */
+int illum_replay_add(struct illum *illum, int fd, dev_t devnum EV_P__);
+
+/*
+ * Remove every input and backlight (joining the writer threads, so queued
+ * writes are dropped). Sockets and udev are left alone, this is for tools
+ * that exit right after.
+ */
+void illum_fini(struct illum *illum EV_P__);
+
+#endif
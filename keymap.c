@@ -0,0 +1,265 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#include "keymap.h"
+#include "curve.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* libevdev */
+#include <libevdev/libevdev.h>
+
+/* ccan */
+#include <ccan/str/str.h>
+#include <ccan/array_size/array_size.h>
+
+const unsigned keymap_mod_keys[KEYMAP_MOD_KEY_CT] = {
+	KEY_LEFTSHIFT, KEY_RIGHTSHIFT,
+	KEY_LEFTCTRL, KEY_RIGHTCTRL,
+	KEY_LEFTALT, KEY_RIGHTALT,
+	KEY_LEFTMETA, KEY_RIGHTMETA,
+};
+
+static const char *const mod_names[KEYMAP_MOD_BITS] = {
+	"shift",
+	"ctrl",
+	"alt",
+	"meta",
+};
+
+static const char *const default_bindings[] = {
+	"KEY_BRIGHTNESSUP=up",
+	"KEY_BRIGHTNESSDOWN=down",
+};
+
+static int
+keymap_mod_key(unsigned code)
+{
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(keymap_mod_keys); i++)
+		if (keymap_mod_keys[i] == code)
+			return i;
+	return -1;
+}
+
+/* rebuild keys and mods_used after the table changed */
+static int
+keymap_scan(struct keymap *km)
+{
+	size_t ct = 0;
+	unsigned code, m;
+
+	km->mods_used = false;
+	for (code = 0; code < KEY_CNT; code++) {
+		bool bound = false;
+		for (m = 0; m < KEYMAP_MOD_CT; m++) {
+			const struct keymap_entry *e = keymap_lookup(km, code, m);
+			if (e->act == KEYMAP_NONE || e->act == KEYMAP_MOD)
+				continue;
+			bound = true;
+			if (m && e->exact)
+				km->mods_used = true;
+		}
+
+		if (bound) {
+			unsigned *k = realloc(km->keys, (ct + 1) * sizeof(*k));
+			if (!k)
+				return -ENOMEM;
+			km->keys = k;
+			km->keys[ct++] = code;
+		}
+	}
+
+	km->key_ct = ct;
+	return 0;
+}
+
+static int
+keymap_parse_pct(const char *arg, bool need, int32_t def, int32_t *res)
+{
+	if (!arg) {
+		*res = def;
+		return need ? -EINVAL : 0;
+	}
+
+	char *end;
+	double pct = strtod(arg, &end);
+	if (end == arg || *end || pct < 0 || pct > 100)
+		return -EINVAL;
+
+	*res = pct * CURVE_POS_ONE / 100;
+	return 0;
+}
+
+/*
+ * A step that goes nowhere would still repeat while held, waking us every
+ * hold_interval for nothing.
+ */
+static int
+keymap_parse_step(const char *arg, int32_t *res)
+{
+	int r = keymap_parse_pct(arg, false, CURVE_POS_PERCENT(5), res);
+	if (!r && !*res)
+		return -EINVAL;
+	return r;
+}
+
+static int
+keymap_parse_action(const char *s, struct keymap_entry *e)
+{
+	const char *arg = strchr(s, ':');
+	size_t len = arg ? (size_t)(arg - s) : strlen(s);
+	if (arg)
+		arg++;
+
+	if (len == 2 && strstarts(s, "up")) {
+		e->act = KEYMAP_STEP;
+		return keymap_parse_step(arg, &e->arg);
+	} else if (len == 4 && strstarts(s, "down")) {
+		e->act = KEYMAP_STEP;
+		int r = keymap_parse_step(arg, &e->arg);
+		e->arg = -e->arg;
+		return r;
+	} else if (len == 3 && strstarts(s, "set")) {
+		e->act = KEYMAP_SET;
+		return keymap_parse_pct(arg, true, 0, &e->arg);
+	} else if (len == 6 && strstarts(s, "preset")) {
+		e->act = KEYMAP_PRESET;
+		return keymap_parse_pct(arg, true, 0, &e->arg);
+	} else if (!arg && streq(s, "off")) {
+		e->act = KEYMAP_OFF;
+		e->arg = 0;
+		return 0;
+	} else if (!arg && streq(s, "none")) {
+		e->act = KEYMAP_NONE;
+		e->arg = 0;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* "KEY_F5", "f5" or "63" */
+static int
+keymap_parse_key(const char *s, size_t len)
+{
+	char name[64] = "KEY_";
+	size_t off = strlen(name), i;
+
+	if (!len || len >= sizeof(name) - off)
+		return -EINVAL;
+
+	if (isdigit((unsigned char)*s)) {
+		char *end;
+		unsigned long code = strtoul(s, &end, 0);
+		if ((size_t)(end - s) != len || code >= KEY_CNT)
+			return -EINVAL;
+		return code;
+	}
+
+	if (len > off && !strncasecmp(s, name, off))
+		off = 0;
+	for (i = 0; i < len; i++)
+		name[off + i] = toupper((unsigned char)s[i]);
+	name[off + len] = '\0';
+
+	int code = libevdev_event_code_from_name(EV_KEY, name);
+	return code < 0 || code >= KEY_CNT ? -EINVAL : code;
+}
+
+int keymap_bind(struct keymap *km, const char *spec)
+{
+	const char *eq = strchr(spec, '=');
+	if (!eq)
+		return -EINVAL;
+
+	struct keymap_entry e = { 0 };
+	int r = keymap_parse_action(eq + 1, &e);
+	if (r < 0)
+		return r;
+
+	/* modifiers, then the key */
+	unsigned mods = 0;
+	const char *p = spec;
+	for (;;) {
+		const char *plus = memchr(p, '+', eq - p);
+		if (!plus)
+			break;
+
+		size_t i, len = plus - p;
+		for (i = 0; i < KEYMAP_MOD_BITS; i++)
+			if (strlen(mod_names[i]) == len && !strncasecmp(p, mod_names[i], len))
+				break;
+		if (i == KEYMAP_MOD_BITS)
+			return -EINVAL;
+
+		mods |= 1u << i;
+		p = plus + 1;
+	}
+
+	int code = keymap_parse_key(p, eq - p);
+	if (code < 0 || keymap_mod_key(code) >= 0)
+		return -EINVAL;
+
+	/*
+	 * A binding with modifiers is for exactly those. One without is also
+	 * the fallback for every modifier state that isn't bound exactly.
+	 */
+	unsigned m;
+	for (m = 0; m < KEYMAP_MOD_CT; m++) {
+		struct keymap_entry *t = &km->table[code << KEYMAP_MOD_BITS | m];
+		if (m == mods) {
+			*t = e;
+			t->exact = !!mods;
+		} else if (!mods && !t->exact) {
+			*t = e;
+		}
+	}
+
+	return keymap_scan(km);
+}
+
+bool keymap_keys_eq(const struct keymap *a, const struct keymap *b)
+{
+	return a->key_ct == b->key_ct && a->mods_used == b->mods_used &&
+		!memcmp(a->keys, b->keys, a->key_ct * sizeof(*a->keys));
+}
+
+int keymap_init(struct keymap *km)
+{
+	*km = (struct keymap) { 0 };
+	km->table = calloc((size_t)KEY_CNT << KEYMAP_MOD_BITS, sizeof(*km->table));
+	if (!km->table)
+		return -ENOMEM;
+
+	size_t i;
+	unsigned m;
+	for (i = 0; i < ARRAY_SIZE(keymap_mod_keys); i++) {
+		for (m = 0; m < KEYMAP_MOD_CT; m++) {
+			struct keymap_entry *t =
+				&km->table[keymap_mod_keys[i] << KEYMAP_MOD_BITS | m];
+			t->act = KEYMAP_MOD;
+			t->arg = i;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(default_bindings); i++) {
+		int r = keymap_bind(km, default_bindings[i]);
+		if (r < 0) {
+			keymap_free(km);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+void keymap_free(struct keymap *km)
+{
+	free(km->table);
+	free(km->keys);
+	*km = (struct keymap) { 0 };
+}
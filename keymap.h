@@ -0,0 +1,88 @@
+#ifndef ILLUM_KEYMAP_H_
+#define ILLUM_KEYMAP_H_
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+/*
+ * Key bindings, compiled into a flat table with one entry per key code and
+ * modifier state, so dispatching an event is a single array lookup.
+ *
+ * Bindings are written "[<mod>+...]<key>=<action>":
+ *
+ *   <mod>     shift, ctrl, alt or meta (either side)
+ *   <key>     a key name from linux/input.h, with or without KEY_, or a
+ *             number
+ *   <action>  up[:<pct>]      step up, by 5% of the curve unless given
+ *                             (more than 0)
+ *             down[:<pct>]    step down
+ *             set:<pct>       jump to a level
+ *             preset:<pct>    fade to a level
+ *             off             turn the backlight off, or back on
+ *             none            remove a binding
+ *
+ * A binding without modifiers applies to every modifier state that has no
+ * binding of its own, so bindings can be given in any order. Modifier keys
+ * themselves are always in the table (as KEYMAP_MOD) so a device's modifier
+ * state is tracked by the same lookup.
+ */
+#define KEYMAP_MOD_BITS 4
+#define KEYMAP_MOD_CT (1u << KEYMAP_MOD_BITS)
+/* left and right of each modifier, in the order of their bits */
+#define KEYMAP_MOD_KEY_CT (KEYMAP_MOD_BITS * 2)
+
+enum keymap_act {
+	KEYMAP_NONE,
+	/* arg is the index in keymap_mod_keys */
+	KEYMAP_MOD,
+	/* arg is the step in curve positions, negative down */
+	KEYMAP_STEP,
+	/* arg is the curve position, jumped to or faded to */
+	KEYMAP_SET,
+	KEYMAP_PRESET,
+	KEYMAP_OFF,
+};
+
+struct keymap_entry {
+	uint8_t act;
+	/* bound for exactly this modifier state, see keymap_bind() */
+	uint8_t exact;
+	int32_t arg;
+};
+
+struct keymap {
+	/* KEY_CNT << KEYMAP_MOD_BITS entries, see keymap_lookup() */
+	struct keymap_entry *table;
+
+	/*
+	 * The keys that have an action, which decide whether a device is
+	 * worth opening, and whether any binding needs modifiers (and so
+	 * modifier events need to be delivered).
+	 */
+	unsigned *keys;
+	size_t key_ct;
+	bool mods_used;
+};
+
+extern const unsigned keymap_mod_keys[KEYMAP_MOD_KEY_CT];
+
+/* the default bindings: brightness keys step by 5% */
+int keymap_init(struct keymap *km);
+void keymap_free(struct keymap *km);
+
+/* add (or replace) a binding, returns 0 or negative if @spec is bad */
+int keymap_bind(struct keymap *km, const char *spec);
+
+/* do @a and @b need the same key events (whatever they do with them)? */
+bool keymap_keys_eq(const struct keymap *a, const struct keymap *b);
+
+static inline const struct keymap_entry *
+keymap_lookup(const struct keymap *km, unsigned code, unsigned mods)
+{
+	return &km->table[code << KEYMAP_MOD_BITS | mods];
+}
+
+#endif
@@ -0,0 +1,66 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#include "latency.h"
+
+#include <stdio.h>
+
+static unsigned
+lat_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	if (!us)
+		return 0;
+
+	unsigned b = 64 - __builtin_clzll(us);
+	return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+void lat_hist_add(struct lat_hist *h, uint64_t start, uint64_t end)
+{
+	uint64_t ns = end > start ? end - start : 0;
+
+	h->ct[lat_bucket(ns)]++;
+	h->n++;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+}
+
+uint64_t lat_hist_pct_us(const struct lat_hist *h, unsigned pct)
+{
+	/* the sample at rank ceil(n * pct / 100) */
+	uint64_t rank = (h->n * pct + 99) / 100, seen = 0;
+	unsigned b;
+
+	if (!h->n)
+		return 0;
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		seen += h->ct[b];
+		if (seen >= rank)
+			break;
+	}
+
+	return UINT64_C(1) << b;
+}
+
+size_t lat_hist_fmt(const struct lat_hist *h, char *buf, size_t sz)
+{
+	size_t len = 0;
+	unsigned b;
+
+	if (sz)
+		buf[0] = '\0';
+
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		if (!h->ct[b])
+			continue;
+
+		int r = snprintf(buf + len, sz - len, "%s%llu:%llu", len ? " " : "",
+				(unsigned long long)UINT64_C(1) << b,
+				(unsigned long long)h->ct[b]);
+		if (r < 0 || (size_t)r >= sz - len)
+			return sz ? sz - 1 : 0;
+		len += r;
+	}
+
+	return len;
+}
@@ -0,0 +1,57 @@
+#ifndef ILLUM_LATENCY_H_
+#define ILLUM_LATENCY_H_
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Latency histograms with fixed power of two buckets, cheap enough to
+ * record every sample unconditionally: an add is a count-leading-zeros and
+ * two increments, with no allocation or locking of its own (callers that
+ * share a histogram between threads provide that).
+ *
+ * Bucket 0 holds samples under 1us, and bucket b (b > 0) those in
+ * [2^(b-1), 2^b) us. The last bucket also holds everything longer.
+ */
+#define LAT_BUCKETS 24
+
+struct lat_hist {
+	uint64_t ct[LAT_BUCKETS];
+	uint64_t n;
+	uint64_t max_ns;
+};
+
+/*
+ * Timestamps (CLOCK_MONOTONIC, in ns) of one input event as it becomes a
+ * backlight write. event is 0 for writes that weren't caused by an input
+ * event (fades after the first frame, idle dimming, etc).
+ */
+struct lat_stamp {
+	uint64_t event;		/* the kernel's timestamp on the input event */
+	uint64_t dispatch;	/* our input callback started */
+	uint64_t post;		/* the raw value was handed to the writer */
+};
+
+static inline uint64_t
+lat_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* add the time from @start to @end, which may be out of order */
+void lat_hist_add(struct lat_hist *h, uint64_t start, uint64_t end);
+
+/* upper bound (in us) of the bucket holding the @pct percentile sample */
+uint64_t lat_hist_pct_us(const struct lat_hist *h, unsigned pct);
+
+/*
+ * Format the non-empty buckets as "<upper bound us>:<count>" pairs into @buf.
+ * Returns the length (truncated to fit @sz, and nul terminated).
+ */
+size_t lat_hist_fmt(const struct lat_hist *h, char *buf, size_t sz);
+
+#endif
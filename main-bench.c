@@ -0,0 +1,1405 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+/*
+ * Replay input events through illum-d's key handling, against fake
+ * backlights, and report how fast and how costly it was.
+ *
+ * The events (recorded with illum-d -R, or synthesized) are fed over a pipe
+ * to an input added with illum_replay_add(), so from there on everything is
+ * the daemon's own code: evdev handling, hold/flush/fade, the curve and the
+ * per-backlight writer threads. The backlights are directories on a tmpfs
+ * laid out like /sys/class/backlight/<name>, so writes cost a real (if fast)
+ * write() but nothing touches hardware.
+ *
+ * With -S or -s, a scripted device source replays a hotplug storm (device
+ * add/remove/change events against fake sysfs directories and device nodes)
+ * through illum_dev_event() while keys are pressed at their recorded pace,
+ * and the key latency is then measured again without the storm.
+ *
+ * With -w, the bench ends with an idle check: once everything the replay
+ * set off has settled, the daemon must not wake up at all for a while.
+ *
+ * -L skips all of that and times the curve's lookups and searches alone, and
+ * -A the brightness attribute's reads and writes, against the way they were
+ * done before attr.c kept the fds open.
+ */
+
+/* mkdtemp(), pipe2() */
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "attr.h"
+#include "illum.h"
+
+/* ccan */
+#include <ccan/pr_log/pr_log.h>
+#include <ccan/str/str.h>
+#include <ccan/array_size/array_size.h>
+#include <ccan/container_of/container_of.h>
+
+static const char *opts = "Vh" ILLUM_CONF_OPTS "n:m:g:N:pD:S:s:I:w:L:A:B:";
+static
+void usage_(const char *pn)
+{
+	fprintf(stderr,
+		"illum-%s\n"
+		"Benchmark illum-d's input to backlight path by replaying events\n"
+		"\n"
+		"usage: %s [options] [<trace>...]\n"
+		"\n"
+		"A trace is a file of struct input_event, as recorded by illum-d -R\n"
+		"or read from /dev/input/event*. Without one, -g presses are made up.\n"
+		"\n"
+		"options:\n"
+		" -h			print this help\n"
+		" -V			print version info\n"
+		" -n <count>		fake backlights (default 1). They all look like\n"
+		"			one panel, so only one is written unless the others\n"
+		"			are forced in with -b bench<N>\n"
+		" -m <max>		their max_brightness (default 1000)\n"
+		" -g <presses>		synthesize this many key presses (default 1000)\n"
+		" -N <count>		replay the events this many times (default 1)\n"
+		" -p			pace the replay like the recording instead of\n"
+		"			replaying as fast as possible\n"
+		" -D <dir>		create the fake devices below this (tmpfs)\n"
+		"			directory, default $XDG_RUNTIME_DIR or /dev/shm\n"
+		"\n"
+		"hotplug storm:\n"
+		" -S <events>		replay this many generated device events\n"
+		" -I <inputs>		fake input devices they cycle through (default 64)\n"
+		" -s <script>		replay device events from <script> instead, one\n"
+		"			per line:\n"
+		"			  add|remove|change backlight <dir>\n"
+		"			  add|remove|change input <dir> <node> <major>:<minor>\n"
+		"\n"
+		"idle check:\n"
+		" -w <msec>		after the replay, and once fades, held keys and\n"
+		"			idle dimming (-t) have had time to finish, fail if\n"
+		"			anything wakes the event loop for <msec>\n"
+		"\n"
+		"curve:\n"
+		" -L <count>		instead of replaying, time <count> lookups and\n"
+		"			searches on the curve (-c, -l) for -m's max\n"
+		"\n"
+		"brightness attribute:\n"
+		" -A <count>		instead of replaying, time <count> reads and\n"
+		"			writes of a fake backlight's brightness, reopening\n"
+		"			it for each and with the fds kept open\n"
+		" -B <dir>		use this backlight (like /sys/class/backlight/x)\n"
+		"			instead, writing back the level it is at\n"
+		"\n"
+		"illum-d's -b, -c, -l, -f, -F, -r, -H, -t and -k apply as well.\n"
+		, stringify(CFG_GIT_VERSION), pn);
+}
+
+#define usage() usage_(argc?argv[0]:"illum-bench")
+
+/* one stream of key events into illum_replay_add(), written by inject() */
+struct replay {
+	const struct input_event *evs;
+	size_t ev_ct;
+	unsigned long repeat;
+	bool paced;
+
+	/* end early: when set, or once max_presses (if not 0) were written */
+	atomic_bool stop;
+	uintmax_t max_presses;
+	uintmax_t presses;
+
+	/* write end of the replay pipe, closed by inject() when done */
+	int fd;
+	dev_t devnum;
+	pthread_barrier_t go;
+	pthread_t thread;
+};
+
+/*
+ * The scripted device source: the script is written into a pipe by
+ * storm_feed() as fast as it will go, and read back by storm_cb() in the
+ * event loop the same way udev-src.c reads the netlink socket.
+ */
+struct storm {
+	struct illum *illum;
+	/* stopped once the storm is over */
+	struct replay *keys;
+
+	char *script;
+	size_t script_len;
+	int fd;
+	pthread_barrier_t go;
+	pthread_t thread;
+
+	ev_io w;
+	size_t len;
+	char buf[8192];
+	bool eof;
+
+	uintmax_t events;
+	uintmax_t bad;
+	/* when the last event was handled, and the last probe done */
+	uint64_t end;
+};
+
+/* ends a phase once its replay is over and nothing is left in flight */
+struct phase {
+	struct illum *illum;
+	struct replay *keys;
+	struct storm *storm;
+	ev_prepare w;
+};
+
+static uint64_t
+ev_ns(const struct input_event *ev)
+{
+	return (uint64_t)ev->input_event_sec * 1000000000
+		+ (uint64_t)ev->input_event_usec * 1000;
+}
+
+static bool
+ev_is_press(const struct input_event *ev)
+{
+	return ev->type == EV_KEY && ev->value == 1 &&
+		(ev->code == KEY_BRIGHTNESSUP || ev->code == KEY_BRIGHTNESSDOWN);
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t r = write(fd, p, len);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand the events over one report (up to and including the EV_SYN) per
+ * write, like the kernel delivers them, stamped with the time they are
+ * written so the daemon's latency histograms measure from here.
+ */
+static void *
+inject(void *arg)
+{
+	struct replay *rp = arg;
+	/* whole events per write, see replay_cb() */
+	struct input_event buf[PIPE_BUF / sizeof(struct input_event)];
+	uint64_t base = ev_ns(&rp->evs[0]);
+	uint64_t span = ev_ns(&rp->evs[rp->ev_ct - 1]) - base;
+	unsigned long rep;
+
+	pthread_barrier_wait(&rp->go);
+	uint64_t start = lat_now();
+	for (rep = 0; rep < rp->repeat; rep++) {
+		size_t i = 0;
+		while (i < rp->ev_ct) {
+			if (atomic_load(&rp->stop) ||
+					(rp->max_presses && rp->presses >= rp->max_presses))
+				goto out;
+
+			size_t n = 0;
+			while (i + n < rp->ev_ct && n < ARRAY_SIZE(buf)) {
+				buf[n] = rp->evs[i + n];
+				rp->presses += ev_is_press(&buf[n]);
+				if (buf[n++].type == EV_SYN)
+					break;
+			}
+
+			if (rp->paced) {
+				uint64_t at = start + rep * span + ev_ns(&rp->evs[i]) - base;
+				uint64_t now = lat_now();
+				if (at > now) {
+					struct timespec ts = {
+						.tv_sec = (at - now) / 1000000000,
+						.tv_nsec = (at - now) % 1000000000,
+					};
+					nanosleep(&ts, NULL);
+				}
+			}
+
+			uint64_t now = lat_now();
+			size_t j;
+			for (j = 0; j < n; j++) {
+				buf[j].input_event_sec = now / 1000000000;
+				buf[j].input_event_usec = now % 1000000000 / 1000;
+			}
+
+			if (write_all(rp->fd, buf, n * sizeof(buf[0])) < 0) {
+				pr_error("replay pipe: %s\n", strerror(errno));
+				goto out;
+			}
+			i += n;
+		}
+	}
+
+out:
+	close(rp->fd);
+	return NULL;
+}
+
+/*
+ * Start @rp's thread (waiting for rp->go) and add the other end of its pipe
+ * as an input.
+ */
+static int
+replay_start(struct replay *rp, struct illum *illum, dev_t devnum EV_P__)
+{
+	int pfd[2];
+	if (pipe2(pfd, O_CLOEXEC))
+		return -errno;
+
+	rp->fd = pfd[1];
+	rp->devnum = devnum;
+	atomic_init(&rp->stop, false);
+	pthread_barrier_init(&rp->go, NULL, 2);
+	if (pthread_create(&rp->thread, NULL, inject, rp)) {
+		close(pfd[0]);
+		close(pfd[1]);
+		return -EAGAIN;
+	}
+
+	int r = illum_replay_add(illum, pfd[0], devnum EV_A__);
+	if (r < 0) {
+		/* gets EPIPE */
+		close(pfd[0]);
+		pthread_barrier_wait(&rp->go);
+		pthread_join(rp->thread, NULL);
+		return r;
+	}
+
+	return 0;
+}
+
+static int
+trace_load(struct replay *rp, struct input_event **evs_, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "E: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size % sizeof(struct input_event)) {
+		fprintf(stderr, "E: %s is not a trace of struct input_event\n", path);
+		close(fd);
+		return -1;
+	}
+
+	size_t n = st.st_size / sizeof(struct input_event);
+	struct input_event *evs = realloc(*evs_, (rp->ev_ct + n) * sizeof(*evs));
+	if (!evs) {
+		close(fd);
+		return -1;
+	}
+	*evs_ = evs;
+
+	size_t len = n * sizeof(*evs);
+	char *p = (char *)(evs + rp->ev_ct);
+	while (len) {
+		ssize_t r = read(fd, p, len);
+		if (r <= 0) {
+			fprintf(stderr, "E: %s: short read\n", path);
+			close(fd);
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+
+	close(fd);
+	rp->ev_ct += n;
+	return 0;
+}
+
+/*
+ * Presses 20ms apart (for -p), 5 up then 5 down so the 5% steps never get
+ * stuck at either end of the curve.
+ */
+static int
+trace_synth(struct replay *rp, struct input_event **evs_, unsigned long presses)
+{
+	struct input_event *evs = calloc(presses * 4, sizeof(*evs));
+	if (!evs)
+		return -1;
+
+	unsigned long i;
+	for (i = 0; i < presses; i++) {
+		struct input_event *ev = evs + i * 4;
+		uint64_t t = i * 20000000;
+		unsigned j;
+		for (j = 0; j < 4; j++) {
+			ev[j].input_event_sec = t / 1000000000;
+			ev[j].input_event_usec = t % 1000000000 / 1000;
+			ev[j].type = j % 2 ? EV_SYN : EV_KEY;
+			ev[j].code = j % 2 ? SYN_REPORT :
+				i / 5 % 2 ? KEY_BRIGHTNESSDOWN : KEY_BRIGHTNESSUP;
+			ev[j].value = j == 0;
+		}
+	}
+
+	*evs_ = evs;
+	rp->ev_ct = presses * 4;
+	return 0;
+}
+
+static int
+put_attr(const char *dir, const char *name, const char *val)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+
+	int r = write_all(fd, val, strlen(val));
+	close(fd);
+	return r;
+}
+
+static int
+fake_backlight(const char *dir, unsigned long max, const char *type)
+{
+	char max_s[32], cur_s[32];
+	snprintf(max_s, sizeof(max_s), "%lu\n", max);
+	snprintf(cur_s, sizeof(cur_s), "%lu\n", max / 2);
+
+	if (mkdir(dir, 0755))
+		return -1;
+
+	if (put_attr(dir, "max_brightness", max_s) ||
+			put_attr(dir, "brightness", cur_s) ||
+			put_attr(dir, "actual_brightness", cur_s) ||
+			put_attr(dir, "type", type))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Input @i's sysfs directory (inputN/eventN, with the key bitmap of inputN
+ * in eventN/device/capabilities/key) and its node. The node is a fifo:
+ * opening it works without root, and libevdev rejects it like a device
+ * without the ioctls.
+ */
+#define BITS_PER_LONG (sizeof(unsigned long) * CHAR_BIT)
+
+static int
+fake_input(const char *root, unsigned long i, bool keys)
+{
+	unsigned long words[KEY_CNT / BITS_PER_LONG + 1] = { 0 };
+	char caps[512], path[PATH_MAX];
+	size_t len = 0;
+	int w;
+
+	if (keys) {
+		words[KEY_BRIGHTNESSUP / BITS_PER_LONG] |= 1UL << (KEY_BRIGHTNESSUP % BITS_PER_LONG);
+		words[KEY_BRIGHTNESSDOWN / BITS_PER_LONG] |= 1UL << (KEY_BRIGHTNESSDOWN % BITS_PER_LONG);
+	}
+
+	/* like the kernel: most significant first, leading zero words dropped */
+	for (w = ARRAY_SIZE(words) - 1; w > 0 && !words[w]; w--)
+		;
+	for (; w >= 0; w--)
+		len += snprintf(caps + len, sizeof(caps) - len, "%lx%s",
+				words[w], w ? " " : "\n");
+
+	static const char *const dirs[] = {
+		"%s/input%lu",
+		"%s/input%lu/event%lu",
+		"%s/input%lu/event%lu/device",
+		"%s/input%lu/event%lu/device/capabilities",
+	};
+	size_t d;
+	for (d = 0; d < ARRAY_SIZE(dirs); d++) {
+		snprintf(path, sizeof(path), dirs[d], root, i, i);
+		if (mkdir(path, 0755))
+			return -1;
+	}
+
+	if (put_attr(path, "key", caps))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/node%lu", root, i);
+	return mkfifo(path, 0600);
+}
+
+static int
+rm_one(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)ftw;
+	return flag == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+static void
+rm_tree(const char *root)
+{
+	nftw(root, rm_one, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int
+script_add(char **script, size_t *len, size_t *cap, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static int
+script_add(char **script, size_t *len, size_t *cap, const char *fmt, ...)
+{
+	va_list ap;
+	for (;;) {
+		va_start(ap, fmt);
+		int n = vsnprintf(*script + *len, *cap - *len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return -1;
+		if ((size_t)n < *cap - *len) {
+			*len += n;
+			return 0;
+		}
+
+		size_t ncap = *cap ? *cap * 2 : 65536;
+		char *s = realloc(*script, ncap);
+		if (!s)
+			return -1;
+		*script = s;
+		*cap = ncap;
+	}
+}
+
+/* backlights that come and go during a generated storm */
+#define STORM_BACKLIGHTS 2
+
+/*
+ * A docking station's worth of churn: each of @inputs fake inputs cycles
+ * through add, change and remove (one in 8 has brightness keys, so it gets
+ * to libevdev), bench0 gets a change event every 16th event (a sysfs read
+ * each) and every 64th adds or removes a spare backlight (a writer thread
+ * and a re-selection each).
+ */
+static int
+storm_gen(struct storm *sm, const char *root, unsigned long events,
+		unsigned long inputs)
+{
+	size_t cap = 0;
+	unsigned long i;
+	char dir[PATH_MAX];
+
+	unsigned char *state = calloc(inputs, 1);
+	if (!state)
+		return -1;
+
+	for (i = 0; i < inputs; i++)
+		if (fake_input(root, i, i % 8 == 0))
+			goto err;
+
+	for (i = 0; i < STORM_BACKLIGHTS; i++) {
+		snprintf(dir, sizeof(dir), "%s/storm%lu", root, i);
+		if (fake_backlight(dir, 100, "firmware\n"))
+			goto err;
+	}
+
+	unsigned long cur = 0, spare = 0;
+	for (i = 0; i < events; i++) {
+		int r;
+		if (i % 64 == 63) {
+			unsigned long b = spare++ % (2 * STORM_BACKLIGHTS);
+			r = script_add(&sm->script, &sm->script_len, &cap,
+					"%s backlight %s/storm%lu\n",
+					b < STORM_BACKLIGHTS ? "add" : "remove",
+					root, b % STORM_BACKLIGHTS);
+		} else if (i % 16 == 15) {
+			r = script_add(&sm->script, &sm->script_len, &cap,
+					"change backlight %s/bench0\n", root);
+		} else {
+			static const char *const actions[] = { "add", "change", "remove" };
+			unsigned long n = cur++ % inputs;
+			r = script_add(&sm->script, &sm->script_len, &cap,
+					"%s input %s/input%lu/event%lu %s/node%lu 0:%lu\n",
+					actions[state[n]], root, n, n, root, n, 100 + n);
+			state[n] = (state[n] + 1) % ARRAY_SIZE(actions);
+		}
+
+		if (r)
+			goto err;
+	}
+
+	free(state);
+	return 0;
+
+err:
+	free(state);
+	return -1;
+}
+
+static int
+storm_load(struct storm *sm, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "E: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "E: %s: %s\n", path, strerror(errno));
+		goto e_close;
+	}
+
+	/* an empty script is an empty storm */
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
+
+	sm->script = malloc(st.st_size);
+	if (!sm->script)
+		goto e_close;
+
+	ssize_t r = read(fd, sm->script, st.st_size);
+	if (r != st.st_size) {
+		fprintf(stderr, "E: %s: short read\n", path);
+		goto e_free;
+	}
+
+	close(fd);
+	sm->script_len = r;
+	return 0;
+
+e_free:
+	free(sm->script);
+	sm->script = NULL;
+e_close:
+	close(fd);
+	return -1;
+}
+
+static void
+storm_free(struct storm *sm)
+{
+	if (!sm)
+		return;
+
+	free(sm->script);
+	free(sm);
+}
+
+static void *
+storm_feed(void *arg)
+{
+	struct storm *sm = arg;
+
+	pthread_barrier_wait(&sm->go);
+	if (write_all(sm->fd, sm->script, sm->script_len) < 0)
+		pr_error("storm pipe: %s\n", strerror(errno));
+	close(sm->fd);
+	return NULL;
+}
+
+static void
+storm_line(struct storm *sm, char *line EV_P__)
+{
+	char *save, *action, *kind, *arg[3];
+	size_t n;
+
+	action = strtok_r(line, " \t", &save);
+	kind = strtok_r(NULL, " \t", &save);
+	for (n = 0; n < ARRAY_SIZE(arg); n++)
+		arg[n] = strtok_r(NULL, " \t", &save);
+
+	/* blank lines and comments */
+	if (!action || *action == '#')
+		return;
+
+	struct illum_dev d = {
+		.syspath = arg[0],
+		.id_input = -1,
+		.id_key = -1,
+	};
+
+	if (streq(action, "add"))
+		d.action = ILLUM_DEV_ADD;
+	else if (streq(action, "remove"))
+		d.action = ILLUM_DEV_REMOVE;
+	else if (streq(action, "change"))
+		d.action = ILLUM_DEV_CHANGE;
+	else
+		goto bad;
+
+	if (!kind || !arg[0]) {
+		goto bad;
+	} else if (streq(kind, "backlight")) {
+		d.kind = ILLUM_DEV_BACKLIGHT;
+	} else if (streq(kind, "input")) {
+		unsigned maj, min;
+		if (!arg[1] || !arg[2] || sscanf(arg[2], "%u:%u", &maj, &min) != 2)
+			goto bad;
+		d.kind = ILLUM_DEV_INPUT;
+		d.devnode = arg[1];
+		d.devnum = makedev(maj, min);
+	} else {
+		goto bad;
+	}
+
+	sm->events++;
+	illum_dev_event(sm->illum, &d EV_A__);
+	return;
+
+bad:
+	sm->bad++;
+}
+
+static void
+storm_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct storm *sm = container_of(w, struct storm, w);
+	for (;;) {
+		ssize_t r = read(w->fd, sm->buf + sm->len, sizeof(sm->buf) - 1 - sm->len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && errno == EAGAIN)
+			break;
+
+		if (r <= 0) {
+			ev_io_stop(EV_A_ w);
+			close(w->fd);
+			sm->eof = true;
+			break;
+		}
+
+		sm->len += r;
+		sm->buf[sm->len] = '\0';
+
+		char *p = sm->buf, *nl;
+		while ((nl = strchr(p, '\n'))) {
+			*nl = '\0';
+			storm_line(sm, p EV_A__);
+			p = nl + 1;
+		}
+
+		sm->len -= p - sm->buf;
+		memmove(sm->buf, p, sm->len);
+		if (sm->len == sizeof(sm->buf) - 1) {
+			pr_warn("storm: dropping an overlong line\n");
+			sm->len = 0;
+		}
+	}
+}
+
+static int
+storm_start(struct storm *sm, struct illum *illum, struct replay *keys EV_P__)
+{
+	int pfd[2];
+	if (pipe2(pfd, O_CLOEXEC | O_NONBLOCK))
+		return -errno;
+
+	/* only the read end is ours to poll */
+	int fl = fcntl(pfd[1], F_GETFL);
+	fcntl(pfd[1], F_SETFL, fl & ~O_NONBLOCK);
+
+	sm->illum = illum;
+	sm->keys = keys;
+	sm->fd = pfd[1];
+	pthread_barrier_init(&sm->go, NULL, 2);
+	if (pthread_create(&sm->thread, NULL, storm_feed, sm)) {
+		close(pfd[0]);
+		close(pfd[1]);
+		return -EAGAIN;
+	}
+
+	ev_io_init(&sm->w, storm_cb, pfd[0], EV_READ);
+	ev_io_start(EV_A_ &sm->w);
+	return 0;
+}
+
+/*
+ * Runs before each loop iteration blocks, after w_flush (EV_MINPRI), so
+ * flushed steps have already started their fades when it looks.
+ */
+static void
+phase_cb(EV_P_ ev_prepare *w, int revents)
+{
+	(void)revents;
+
+	struct phase *ph = container_of(w, struct phase, w);
+	struct illum *illum = ph->illum;
+	struct storm *sm = ph->storm;
+
+	if (sm && !sm->end && sm->eof && !ev_is_active(&illum->w_probe)) {
+		sm->end = lat_now();
+		atomic_store(&sm->keys->stop, true);
+	}
+
+	if (input_htable_get(&illum->inputs, &ph->keys->devnum) ||
+			(sm && !sm->end) ||
+			ev_is_active(&illum->w_flush) ||
+			ev_is_active(&illum->w_fade) ||
+			ev_is_active(&illum->w_hold))
+		return;
+
+	ev_prepare_stop(EV_A_ w);
+	ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/* run the loop until @keys (and @sm) are over and the writers caught up */
+static void
+phase_run(struct illum *illum, struct replay *keys, struct storm *sm EV_P__)
+{
+	struct phase ph = {
+		.illum = illum,
+		.keys = keys,
+		.storm = sm,
+	};
+
+	ev_prepare_init(&ph.w, phase_cb);
+	ev_set_priority(&ph.w, EV_MINPRI);
+	ev_prepare_start(EV_A_ &ph.w);
+
+	pthread_barrier_wait(&keys->go);
+	if (sm)
+		pthread_barrier_wait(&sm->go);
+
+	ev_run(EV_A_ 0);
+
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		pthread_mutex_lock(&bl->lock);
+		while (bl->mbox_full || bl->inflight) {
+			pthread_mutex_unlock(&bl->lock);
+			sched_yield();
+			pthread_mutex_lock(&bl->lock);
+		}
+		pthread_mutex_unlock(&bl->lock);
+	}
+
+	pthread_join(keys->thread, NULL);
+	if (sm)
+		pthread_join(sm->thread, NULL);
+}
+
+/*
+ * Count every syscall made by this thread and the ones it starts later (the
+ * backlight writers), via the raw_syscalls:sys_enter tracepoint. Needs
+ * tracefs to be readable and a permissive enough perf_event_paranoid.
+ */
+static int
+syscall_counter_open(void)
+{
+	static const char *const ids[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	intmax_t id = -1;
+	size_t i;
+	for (i = 0; i < ARRAY_SIZE(ids) && id < 0; i++)
+		id = attr_read_int_at(AT_FDCWD, ids[i]);
+	if (id < 0)
+		return -ENOENT;
+
+	struct perf_event_attr pa = {
+		.type = PERF_TYPE_TRACEPOINT,
+		.size = sizeof(pa),
+		.config = id,
+		.disabled = 1,
+		.inherit = 1,
+	};
+	int fd = syscall(SYS_perf_event_open, &pa, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	return fd == -1 ? -errno : fd;
+}
+
+static double
+tv_ms(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_usec - a->tv_usec) / 1e3;
+}
+
+static void
+lat_print(const char *name, const char *stage, const struct lat_hist *h)
+{
+	if (!h->n)
+		return;
+
+	printf("%s: latency %s (us, %ju samples): p50 <%ju  p90 <%ju  p99 <%ju  max %ju\n",
+			name, stage, (uintmax_t)h->n,
+			(uintmax_t)lat_hist_pct_us(h, 50),
+			(uintmax_t)lat_hist_pct_us(h, 90),
+			(uintmax_t)lat_hist_pct_us(h, 99),
+			(uintmax_t)h->max_ns / 1000);
+}
+
+/* per backlight writes and latency, returns the number of failed writes */
+static uintmax_t
+backlights_report(struct illum *illum, const char *phase)
+{
+	uintmax_t errors = 0;
+	struct sys_backlight *bl;
+	tlist2_for_each(&illum->backlights, bl) {
+		char name[128];
+		snprintf(name, sizeof(name), "%s%s", phase, bl->name);
+		printf("%s: %s, %ju writes (%ju failed), %ju superseded before being written\n",
+				name, bl->active ? "active" : "inactive",
+				bl->writes, bl->write_errors, bl->superseded);
+		errors += bl->write_errors;
+
+		unsigned s;
+		for (s = 0; s < LAT_STAGE_CT; s++)
+			lat_print(name, lat_stage_names[s], &bl->lat[s]);
+
+		/* the next phase starts from scratch */
+		memset(bl->lat, 0, sizeof(bl->lat));
+		bl->writes = bl->write_errors = bl->superseded = 0;
+	}
+
+	return errors;
+}
+
+static void
+idle_check_cb(EV_P_ ev_timer *w, int revents)
+{
+	(void)revents;
+	(void)w;
+
+	ev_break(EV_A_ EVBREAK_ALL);
+}
+
+/*
+ * Let everything still in flight finish (the longest a timer driven feature
+ * can take: idle dimming plus its fade, a fade back up, and some slack),
+ * then count the wakeups in @window. Our own timer ending the window is
+ * the only one allowed: any other wakeup (including ones by watchers that
+ * don't account for themselves, see wake.h) or daemon callback is reported,
+ * and the number returned. Without wakeup accounting (see illum_start())
+ * there is nothing to count, which fails the check too.
+ */
+static uintmax_t
+idle_check(struct illum *illum, ev_tstamp window EV_P__)
+{
+	const struct illum_conf *conf = &illum->conf;
+	ev_tstamp settle = conf->idle_timeout + conf->fade_down + conf->fade_up + 1;
+	ev_timer w;
+
+	if (ev_userdata(EV_A) != &illum->wake) {
+		fprintf(stderr, "E: idle: wakeups aren't being accounted\n");
+		return 1;
+	}
+
+	ev_timer_init(&w, idle_check_cb, settle, 0.);
+	ev_timer_start(EV_A_ &w);
+	ev_run(EV_A_ 0);
+
+	struct wake_acct before = illum->wake;
+	ev_timer_set(&w, window, 0.);
+	ev_timer_start(EV_A_ &w);
+	ev_run(EV_A_ 0);
+
+	const struct wake_acct *after = &illum->wake;
+	uintmax_t wakeups = after->wakeups - before.wakeups;
+	/* our timer's, if it was seen at all */
+	if (wakeups)
+		wakeups--;
+	printf("idle: %ju wakeups in %.0f ms, after %.0f ms to settle\n",
+			wakeups, window * 1e3, settle * 1e3);
+
+	uintmax_t calls = 0;
+	unsigned s;
+	for (s = 0; s < WAKE_SRC_CT; s++) {
+		const struct wake_stat *a = &after->src[s], *b = &before.src[s];
+		calls += a->calls - b->calls;
+		uintmax_t woke = a->wakeups - b->wakeups;
+		/* our timer's, unless it shared its wakeup with someone else */
+		if (s == WAKE_OTHER && woke)
+			woke--;
+		if (woke || a->calls != b->calls)
+			printf("idle: %s: woke us %ju times, %ju callbacks\n",
+					wake_src_names[s], woke, a->calls - b->calls);
+	}
+
+	return wakeups + calls;
+}
+
+/* inputs for curve_bench(), cycled through so they stay in cache */
+#define CURVE_BENCH_INPUTS 4096
+
+/*
+ * Time the curve on its own: @count lookups (position to raw, as every
+ * step does) and as many searches (raw to position, as every brightness
+ * read back does), on positions and raw values spread over the whole curve.
+ * Returns non-zero if the curve doesn't take @max.
+ */
+static int
+curve_bench(const struct curve_params *p, uint32_t max, uintmax_t count)
+{
+	struct curve c;
+	if (curve_init(&c, p, max)) {
+		fprintf(stderr, "E: the %s curve can't take max %"PRIu32" (1..%ju)\n",
+				curve_type_name(p->type), max, (uintmax_t)CURVE_MAX);
+		return 1;
+	}
+
+	static uint32_t pos[CURVE_BENCH_INPUTS], raw[CURVE_BENCH_INPUTS];
+	uint32_t x = 2463534242;
+	size_t i;
+	for (i = 0; i < CURVE_BENCH_INPUTS; i++) {
+		/* xorshift32, anything that doesn't walk the table in order */
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		pos[i] = x % (CURVE_POS_ONE + 1);
+		raw[i] = x % ((uint64_t)max + 1);
+	}
+
+	/* summed and printed, so the calls can't be dropped */
+	uint64_t sum = 0;
+	uintmax_t n;
+	uint64_t t0 = lat_now();
+	for (n = 0; n < count; n++)
+		sum += curve_pos_to_raw(&c, pos[n % CURVE_BENCH_INPUTS]);
+	uint64_t t1 = lat_now();
+	for (n = 0; n < count; n++)
+		sum += curve_raw_to_pos(&c, raw[n % CURVE_BENCH_INPUTS]);
+	uint64_t t2 = lat_now();
+
+	printf("curve %s/%u, max %"PRIu32": %.1f ns per lookup, %.1f ns per search (%ju each, check %"PRIu64")\n",
+			curve_type_name(p->type), p->linearity, max,
+			(double)(t1 - t0) / count, (double)(t2 - t1) / count,
+			count, sum);
+	return 0;
+}
+
+/*
+ * Brightness access the way it was done before attr.c kept the fds open:
+ * a lookup, open and close around every read or write, with stdio to parse
+ * and format. Only here to be compared against, see attr_bench().
+ */
+static intmax_t
+attr_reopen_read(int dir_fd, const char *path)
+{
+	int fd = openat(dir_fd, path, O_RDONLY);
+	if (fd == -1)
+		return -2;
+
+	char buf[ATTR_INT_BUF_SZ];
+	ssize_t r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r == -1)
+		return -3;
+	buf[r] = '\0';
+
+	intmax_t res;
+	if (sscanf(buf, "%jd", &res) != 1)
+		return -4;
+	return res;
+}
+
+static int
+attr_reopen_write(int dir_fd, const char *path, intmax_t v)
+{
+	int fd = openat(dir_fd, path, O_WRONLY);
+	if (fd == -1)
+		return -2;
+
+	char buf[ATTR_INT_BUF_SZ];
+	int l = snprintf(buf, sizeof(buf), "%jd", v);
+	ssize_t r = write(fd, buf, l);
+	close(fd);
+	return r == -1 ? -3 : 0;
+}
+
+enum attr_bench_op {
+	ATTR_REOPEN_READ,
+	ATTR_KEPT_READ,
+	ATTR_REOPEN_WRITE,
+	ATTR_KEPT_WRITE,
+	ATTR_BENCH_OP_CT
+};
+
+static const char *const attr_bench_names[ATTR_BENCH_OP_CT] = {
+	[ATTR_REOPEN_READ] = "read, reopened",
+	[ATTR_KEPT_READ] = "read, kept open",
+	[ATTR_REOPEN_WRITE] = "write, reopened",
+	[ATTR_KEPT_WRITE] = "write, kept open",
+};
+
+/*
+ * Time @count reads and writes of @dir's brightness both ways, and count
+ * their syscalls where perf lets us. Writes put back the level it was at,
+ * so a real backlight (-B) doesn't visibly change. Returns non-zero if an
+ * access failed.
+ */
+static int
+attr_bench(const char *dir, uintmax_t count)
+{
+	int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) {
+		fprintf(stderr, "E: %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	int ret = 1;
+	int rfd = attr_open(dir_fd, "brightness", O_RDONLY);
+	int wfd = attr_open(dir_fd, "brightness", O_WRONLY);
+	intmax_t level = rfd < 0 ? -1 : attr_read_int(rfd);
+	if (wfd < 0 || level < 0) {
+		fprintf(stderr, "E: %s/brightness can't be read and written\n", dir);
+		goto out;
+	}
+
+	int sc_fd = syscall_counter_open();
+	unsigned op;
+	for (op = 0; op < ATTR_BENCH_OP_CT; op++) {
+		if (sc_fd >= 0) {
+			ioctl(sc_fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(sc_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+
+		uintmax_t n, errors = 0;
+		uint64_t t0 = lat_now();
+		for (n = 0; n < count; n++) {
+			intmax_t r;
+			switch (op) {
+			case ATTR_REOPEN_READ:
+				r = attr_reopen_read(dir_fd, "brightness");
+				break;
+			case ATTR_KEPT_READ:
+				r = attr_read_int(rfd);
+				break;
+			case ATTR_REOPEN_WRITE:
+				r = attr_reopen_write(dir_fd, "brightness", level);
+				break;
+			default:
+				r = attr_write_int(wfd, level);
+			}
+			errors += r < 0;
+		}
+		uint64_t t1 = lat_now();
+
+		uint64_t syscalls;
+		char sc[32] = "syscalls not counted";
+		if (sc_fd >= 0) {
+			ioctl(sc_fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(sc_fd, &syscalls, sizeof(syscalls)) == sizeof(syscalls))
+				snprintf(sc, sizeof(sc), "%.2f syscalls",
+						(double)syscalls / count);
+		}
+
+		printf("attr %s: %s: %.0f ns, %s per access (%ju, %ju failed)\n",
+				dir, attr_bench_names[op], (double)(t1 - t0) / count,
+				sc, count, errors);
+		if (errors)
+			goto out_sc;
+	}
+
+	ret = 0;
+out_sc:
+	if (sc_fd >= 0)
+		close(sc_fd);
+out:
+	if (rfd >= 0)
+		close(rfd);
+	if (wfd >= 0)
+		close(wfd);
+	close(dir_fd);
+	return ret;
+}
+
+static int
+opt_count(int c, const char *arg, unsigned long *res)
+{
+	char *end;
+	errno = 0;
+	unsigned long x = strtoul(arg, &end, 0);
+	if (errno || end == arg || *end || *arg == '-' || !x || x > UINT32_MAX) {
+		fprintf(stderr, "E: -%c must be a positive integer, got '%s'\n", c, arg);
+		return -1;
+	}
+
+	*res = x;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct illum illum;
+	struct replay keys = { .repeat = 1 }, base = { 0 };
+	struct storm *sm = NULL;
+	struct input_event *evs = NULL;
+	unsigned long bl_ct = 1, max = 1000, presses = 1000, storm_events = 0,
+		      storm_inputs = 64, idle_ms = 0, curve_count = 0,
+		      attr_count = 0;
+	const char *dir = getenv("XDG_RUNTIME_DIR"), *script = NULL,
+	      *attr_dir = NULL;
+	int c, e = 0;
+
+	if (!dir)
+		dir = "/dev/shm";
+
+	if (illum_init(&illum)) {
+		pr_error("out of memory\n");
+		return 1;
+	}
+
+	while ((c = getopt(argc, argv, opts)) != -1) {
+		switch(c) {
+		case 'h':
+			usage();
+			return 0;
+		case 'V':
+			puts("illum-" stringify(CFG_GIT_VERSION));
+			return 0;
+		case 'n':
+			e += !!opt_count(c, optarg, &bl_ct);
+			break;
+		case 'm':
+			e += !!opt_count(c, optarg, &max);
+			break;
+		case 'g':
+			e += !!opt_count(c, optarg, &presses);
+			break;
+		case 'N':
+			e += !!opt_count(c, optarg, &keys.repeat);
+			break;
+		case 'S':
+			e += !!opt_count(c, optarg, &storm_events);
+			break;
+		case 'I':
+			e += !!opt_count(c, optarg, &storm_inputs);
+			break;
+		case 's':
+			script = optarg;
+			break;
+		case 'w':
+			e += !!opt_count(c, optarg, &idle_ms);
+			break;
+		case 'L':
+			e += !!opt_count(c, optarg, &curve_count);
+			break;
+		case 'A':
+			e += !!opt_count(c, optarg, &attr_count);
+			break;
+		case 'B':
+			attr_dir = optarg;
+			break;
+		case 'p':
+			keys.paced = true;
+			break;
+		case 'D':
+			dir = optarg;
+			break;
+		case '?':
+			e++;
+			break;
+		default:
+			if (illum_conf_opt(&illum.conf, c, optarg))
+				e++;
+		}
+	}
+
+	if (attr_dir && !attr_count) {
+		fprintf(stderr, "E: -B needs -A\n");
+		e++;
+	}
+
+	if (e) {
+		usage();
+		return 1;
+	}
+
+	if (curve_count)
+		return curve_bench(&illum.conf.curve, max, curve_count);
+	if (attr_count && attr_dir)
+		return attr_bench(attr_dir, attr_count);
+
+	for (; optind < argc; optind++)
+		if (trace_load(&keys, &evs, argv[optind]))
+			return 1;
+	if (!keys.ev_ct && trace_synth(&keys, &evs, presses))
+		return 1;
+	keys.evs = evs;
+
+	char root[PATH_MAX];
+	snprintf(root, sizeof(root), "%s/illum-bench.XXXXXX", dir);
+	if (!mkdtemp(root)) {
+		fprintf(stderr, "E: could not create a directory in %s: %s\n",
+				dir, strerror(errno));
+		return 1;
+	}
+
+	int ret = 1;
+	unsigned long n;
+	for (n = 0; n < bl_ct; n++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/bench%lu", root, n);
+		if (fake_backlight(path, max, "raw\n")) {
+			fprintf(stderr, "E: could not create %s: %s\n", path, strerror(errno));
+			goto out;
+		}
+	}
+
+	if (attr_count) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/bench0", root);
+		ret = attr_bench(path, attr_count);
+		goto out;
+	}
+
+	if (storm_events || script) {
+		sm = calloc(1, sizeof(*sm));
+		if (!sm)
+			goto out;
+
+		if (script ? storm_load(sm, script) :
+				storm_gen(sm, root, storm_events, storm_inputs)) {
+			fprintf(stderr, "E: could not set up the storm\n");
+			goto out;
+		}
+
+		/* keys at a human pace during the storm, until it is over */
+		keys.paced = true;
+		keys.repeat = ULONG_MAX;
+
+		/* then the same number of presses without it */
+		base = (struct replay) {
+			.evs = keys.evs,
+			.ev_ct = keys.ev_ct,
+			.paced = true,
+			.repeat = ULONG_MAX,
+		};
+	}
+
+	/*
+	 * The helper threads are started before the counter, so their own
+	 * syscalls aren't counted, and the backlights' writers after.
+	 */
+	int r = replay_start(&keys, &illum, makedev(0, 1) EV_DEFAULT__);
+	if (!r && sm)
+		r = storm_start(sm, &illum, &keys EV_DEFAULT__);
+	if (!r && sm)
+		r = replay_start(&base, &illum, makedev(0, 2) EV_DEFAULT__);
+	if (r < 0) {
+		fprintf(stderr, "E: could not start the replay: %s\n", strerror(-r));
+		goto out;
+	}
+	/* held back until its phase, see phase_cb() */
+	if (sm)
+		ev_io_stop(EV_DEFAULT_ &input_htable_get(&illum.inputs, &base.devnum)->w);
+
+	int sc_fd = syscall_counter_open();
+
+	for (n = 0; n < bl_ct; n++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/bench%lu", root, n);
+		r = illum_backlight_add(&illum, path);
+		if (r < 0) {
+			fprintf(stderr, "E: could not add %s: %d\n", path, r);
+			goto out;
+		}
+	}
+
+	/* the idle timer, and the wakeup accounting the idle check needs */
+	if (idle_ms)
+		illum_start(&illum EV_DEFAULT__);
+
+	struct rusage ru0, ru1;
+	getrusage(RUSAGE_SELF, &ru0);
+	if (sc_fd >= 0)
+		ioctl(sc_fd, PERF_EVENT_IOC_ENABLE, 0);
+	uint64_t t0 = lat_now();
+
+	phase_run(&illum, &keys, sm EV_DEFAULT__);
+
+	uint64_t t1 = lat_now();
+	getrusage(RUSAGE_SELF, &ru1);
+	if (sc_fd >= 0)
+		ioctl(sc_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	double secs = (t1 - t0) / 1e9;
+	uintmax_t events = keys.ev_ct * keys.repeat;
+	if (sm) {
+		double storm_secs = (sm->end - t0) / 1e9;
+		printf("storm: %ju device events (%ju malformed) in %.1f ms: %.0f events/s\n",
+				sm->events, sm->bad, storm_secs * 1e3,
+				sm->events / storm_secs);
+		printf("storm: %ju inputs seen, %ju queued, %ju removed before probing, %ju opened, %ju probed\n",
+				illum.stats.input_seen, illum.stats.input_queued,
+				illum.stats.input_collapsed, illum.stats.input_opens,
+				illum.stats.input_probes);
+		printf("replayed %ju key presses alongside\n", keys.presses);
+	} else {
+		printf("replayed %ju events (%ju key presses) in %.1f ms: %.0f events/s, %.0f presses/s\n",
+				events, keys.presses, secs * 1e3, events / secs,
+				keys.presses / secs);
+	}
+	printf("%ju brightness steps in %ju flushes\n",
+			illum.stats.events, illum.stats.flushes);
+	printf("cpu: %.1f ms user, %.1f ms sys; %ld voluntary, %ld involuntary context switches\n",
+			tv_ms(&ru0.ru_utime, &ru1.ru_utime),
+			tv_ms(&ru0.ru_stime, &ru1.ru_stime),
+			ru1.ru_nvcsw - ru0.ru_nvcsw, ru1.ru_nivcsw - ru0.ru_nivcsw);
+
+	uintmax_t errors = backlights_report(&illum, sm ? "storm: " : "");
+
+	if (sm) {
+		if (keys.presses) {
+			base.max_presses = keys.presses;
+			ev_io_start(EV_DEFAULT_ &input_htable_get(&illum.inputs, &base.devnum)->w);
+			phase_run(&illum, &base, NULL EV_DEFAULT__);
+			errors += backlights_report(&illum, "baseline: ");
+		} else {
+			atomic_store(&base.stop, true);
+			pthread_barrier_wait(&base.go);
+			pthread_join(base.thread, NULL);
+		}
+	}
+
+	if (idle_ms && idle_check(&illum, idle_ms / 1e3 EV_DEFAULT__))
+		errors++;
+
+	/* the writers' counts are added to ours as they exit */
+	illum_fini(&illum EV_DEFAULT__);
+
+	uint64_t syscalls;
+	if (sc_fd < 0)
+		printf("syscalls: not counted (%s)\n", strerror(-sc_fd));
+	else if (read(sc_fd, &syscalls, sizeof(syscalls)) == sizeof(syscalls))
+		printf("syscalls%s: %"PRIu64" (%.2f per key press)\n",
+				sm ? " during the storm" : "", syscalls,
+				keys.presses ? (double)syscalls / keys.presses : 0.);
+
+	ret = errors ? 1 : 0;
+out:
+	/* a feeder that never got going is still waiting at its barrier */
+	storm_free(sm);
+	rm_tree(root);
+	return ret;
+}
@@ -1,15 +1,761 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
 /*
- * A simple command line tool to control illumd
+ * A simple command line tool to control illum-d over its control socket,
+ * see ctl-proto.h.
+ *
+ * This deliberately only uses libc (no libev/libudev) so that running it
+ * from scripts and status bars costs little more than the round trip itself.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ctl-proto.h"
+
+/* ccan */
+#include <ccan/str/str.h>
+
+/* '+' stops at the request, which may look like an option ("step -50") */
+static const char *opts = "+Vhs:bL:F:i:";
+static
+void usage_(const char *pn)
+{
+	fprintf(stderr,
+		"illum-%s\n"
+		"Control a running illum-d\n"
+		"\n"
+		"usage: %s [-s <socket>] <request>...\n"
+		"       %s [-s <socket>] -b\n"
+		"       %s [-s <socket>] -L <count> [<request>...]\n"
+		"       %s [-s <socket>] -F <subscribers>\n"
+		"       %s [-s <socket>] -i <dim|all> [<command>...]\n"
+		"\n"
+		"requests:\n"
+		" list				list backlights\n"
+		" get [<backlight>]		brightness in permille\n"
+		" raw [<backlight>]		raw and max brightness\n"
+		" set [<backlight>] <permille>	set brightness\n"
+		" step [<backlight>] <+-permille>	adjust brightness\n"
+		" sub [<msec>]			print brightness changes as they happen,\n"
+		"				at most once per <msec>\n"
+		" stats				wakeups and CPU time spent, by source\n"
+		"\n"
+		"options:\n"
+		" -h		print this help\n"
+		" -V		print version info\n"
+		" -s <path>	control socket (default $ILLUM_CTL_SOCKET or " ILLUM_CTL_PATH ")\n"
+		" -b		batch: read requests from stdin (pipelined) and print each\n"
+		"		response line to stdout\n"
+		" -L <count>	benchmark: time <count> round trips of <request>\n"
+		"		(default 'get'), then the same number pipelined\n"
+		" -F <n>		benchmark: subscribe <n> clients and time how long\n"
+		"		brightness changes take to reach all of them (this\n"
+		"		changes the brightness of the first backlight)\n"
+		" -i <what>	inhibit idle dimming ('dim') or every automatic change\n"
+		"		('all') while <command> runs (it inherits the inhibit),\n"
+		"		or until killed. -s defaults to $ILLUM_INHIBIT_SOCKET or\n"
+		"		" ILLUM_INHIBIT_PATH "\n"
+		, stringify(CFG_GIT_VERSION), pn, pn, pn, pn, pn);
+}
+
+#define usage() usage_(argc?argv[0]:"illum-ctl")
+
+static int
+ctl_connect(const char *path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "E: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		fprintf(stderr, "E: socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		fprintf(stderr, "E: could not connect to %s: %s\n", path,
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t r = send(fd, buf, len, MSG_NOSIGNAL);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/* buffered reads of response lines */
+struct conn {
+	int fd;
+	size_t off, len;
+	char buf[4096];
+};
+
 /*
- * interfaces for control:
- * - dbus
- * - unix socket
+ * Read once from the socket into the buffer.
+ * Returns 0 on success, or negative on error or EOF.
  */
-int main(int argc, char **argv)
+static int
+conn_fill(struct conn *c)
 {
-	(void)argc;
-	(void)argv;
+	if (c->off) {
+		c->len -= c->off;
+		memmove(c->buf, c->buf + c->off, c->len);
+		c->off = 0;
+	}
+
+	/* a full buffer without a newline, see conn_next_line() */
+	if (c->len == sizeof(c->buf))
+		return -EMSGSIZE;
+
+	ssize_t r;
+	do {
+		r = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+	} while (r == -1 && errno == EINTR);
+
+	if (r <= 0)
+		return r ? -errno : -EPIPE;
+
+	c->len += r;
 	return 0;
 }
+
+/*
+ * Take the next complete line (without the newline, truncated to fit @sz)
+ * out of the buffer. Returns 0 on success, or -EAGAIN if there isn't one.
+ */
+static int
+conn_next_line(struct conn *c, char *line, size_t sz)
+{
+	char *p = c->buf + c->off;
+	char *nl = memchr(p, '\n', c->len - c->off);
+	if (!nl)
+		return -EAGAIN;
+
+	size_t n = nl - p;
+	if (n >= sz)
+		n = sz - 1;
+	memcpy(line, p, n);
+	line[n] = '\0';
+	c->off = nl + 1 - c->buf;
+	return 0;
+}
+
+/*
+ * Read the next line into @line (without the newline), blocking until
+ * there is one. Returns 0 on success, or negative on error or EOF.
+ */
+static int
+conn_read_line(struct conn *c, char *line, size_t sz)
+{
+	for (;;) {
+		if (!conn_next_line(c, line, sz))
+			return 0;
+
+		int r = conn_fill(c);
+		if (r < 0)
+			return r;
+	}
+}
+
+/* join @argc words from @argv into a request line in @buf */
+static int
+request_join(char *buf, size_t sz, int argc, char **argv)
+{
+	size_t len = 0;
+	int i;
+	for (i = 0; i < argc; i++) {
+		size_t n = strlen(argv[i]);
+		if (len + n + 2 > sz)
+			return -1;
+		if (i)
+			buf[len++] = ' ';
+		memcpy(buf + len, argv[i], n);
+		len += n;
+	}
+
+	buf[len++] = '\n';
+	return len;
+}
+
+static int
+cmd_one(int fd, const char *req, size_t len)
+{
+	int r = write_all(fd, req, len);
+	if (r < 0) {
+		fprintf(stderr, "E: write: %s\n", strerror(-r));
+		return 2;
+	}
+
+	struct conn c = { .fd = fd };
+	char line[ILLUM_CTL_LINE_MAX];
+	r = conn_read_line(&c, line, sizeof(line));
+	if (r < 0) {
+		fprintf(stderr, "E: read: %s\n", strerror(-r));
+		return 2;
+	}
+
+	if (streq(line, "ok") || strstarts(line, "ok ")) {
+		if (line[2])
+			puts(line + 3);
+		if (!strstarts(req, "sub"))
+			return 0;
+
+		/* print events until illum-d goes away */
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		while (!conn_read_line(&c, line, sizeof(line))) {
+			if (strstarts(line, "ev "))
+				puts(line + 3);
+		}
+
+		fprintf(stderr, "E: connection closed\n");
+		return 2;
+	}
+
+	fprintf(stderr, "E: %s\n", strstarts(line, "err ") ? line + 4 : line);
+	return 1;
+}
+
+/*
+ * Copy stdin to the socket and the responses to stdout as they arrive,
+ * without waiting for each response before sending the next request.
+ *
+ * Returns 0 if every response was "ok", 1 if any were errors, 2 if the
+ * connection failed.
+ */
+static int
+cmd_batch(int fd)
+{
+	char in[4096], out[4096];
+	size_t in_len = 0, in_off = 0;
+	bool in_eof = false, wr_shut = false;
+	char last = '\n';
+	unsigned errs = 0;
+	/*
+	 * How far into the current response line, and whether it still reads
+	 * like "err " (or a bare "err"). Lines can span reads, and "ev" lines
+	 * of a "sub" start with 'e' as well.
+	 */
+	size_t col = 0;
+	bool err = true;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	for (;;) {
+		struct pollfd pfd[2] = {
+			{ .fd = !in_eof && !in_len ? 0 : -1, .events = POLLIN },
+			{ .fd = fd, .events = POLLIN | (in_len ? POLLOUT : 0) },
+		};
+
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "E: poll: %s\n", strerror(errno));
+			return 2;
+		}
+
+		if (pfd[0].revents) {
+			ssize_t r = read(0, in, sizeof(in));
+			if (r > 0) {
+				in_len = r;
+				in_off = 0;
+				last = in[r - 1];
+			} else if (!r || errno != EINTR) {
+				in_eof = true;
+				/* terminate an unterminated last request */
+				if (last != '\n') {
+					in[0] = '\n';
+					in_len = 1;
+					in_off = 0;
+				}
+			}
+		}
+
+		if (pfd[1].revents & POLLOUT) {
+			ssize_t r = send(fd, in + in_off, in_len - in_off, MSG_NOSIGNAL);
+			if (r == -1 && errno != EAGAIN && errno != EINTR) {
+				fprintf(stderr, "E: write: %s\n", strerror(errno));
+				return 2;
+			}
+			if (r > 0)
+				in_off += r;
+			if (in_off == in_len)
+				in_len = in_off = 0;
+		}
+
+		if (in_eof && !in_len && !wr_shut) {
+			/* illum-d hangs up once it has answered everything */
+			shutdown(fd, SHUT_WR);
+			wr_shut = true;
+		}
+
+		if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t r = read(fd, out, sizeof(out));
+			if (!r)
+				break;
+			if (r == -1) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				fprintf(stderr, "E: read: %s\n", strerror(errno));
+				return 2;
+			}
+
+			ssize_t i;
+			for (i = 0; i < r; i++) {
+				char ch = out[i];
+				if (col < 3)
+					err = err && ch == "err"[col];
+				else if (col == 3 && err && (ch == ' ' || ch == '\n'))
+					errs++;
+				col++;
+				if (ch == '\n') {
+					col = 0;
+					err = true;
+				}
+			}
+
+			if (fwrite(out, 1, r, stdout) != (size_t)r)
+				return 2;
+		}
+	}
+
+	fflush(stdout);
+	return errs ? 1 : 0;
+}
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+cmp_double(const void *a_, const void *b_)
+{
+	double a = *(const double *)a_, b = *(const double *)b_;
+	return (a > b) - (a < b);
+}
+
+/* requests in flight at once in the pipelined half of cmd_bench() */
+#define BENCH_DEPTH 64
+
+/*
+ * Round trip latency: @count requests one at a time (each waiting for its
+ * response), then @count pipelined BENCH_DEPTH at a time for throughput.
+ */
+static int
+cmd_bench(const char *path, unsigned long count, const char *req, size_t len)
+{
+	double t0 = now_us();
+	int fd = ctl_connect(path);
+	if (fd < 0)
+		return 2;
+	double t_conn = now_us() - t0;
+
+	double *lat = malloc(count * sizeof(*lat));
+	char *batch = malloc(len * BENCH_DEPTH);
+	if (!lat || !batch) {
+		fprintf(stderr, "E: out of memory\n");
+		return 2;
+	}
+
+	struct conn c = { .fd = fd };
+	char line[ILLUM_CTL_LINE_MAX];
+	unsigned long i, errs = 0;
+	for (i = 0; i < count; i++) {
+		double t = now_us();
+		if (write_all(fd, req, len) < 0 || conn_read_line(&c, line, sizeof(line)) < 0)
+			goto e_conn;
+		lat[i] = now_us() - t;
+		if (!strstarts(line, "ok"))
+			errs++;
+	}
+
+	for (i = 0; i < BENCH_DEPTH; i++)
+		memcpy(batch + i * len, req, len);
+
+	t0 = now_us();
+	for (i = 0; i < count; ) {
+		unsigned long n = count - i < BENCH_DEPTH ? count - i : BENCH_DEPTH;
+		if (write_all(fd, batch, n * len) < 0)
+			goto e_conn;
+		for (i += n; n; n--) {
+			if (conn_read_line(&c, line, sizeof(line)) < 0)
+				goto e_conn;
+			if (!strstarts(line, "ok"))
+				errs++;
+		}
+	}
+	double t_pipe = now_us() - t0;
+
+	qsort(lat, count, sizeof(*lat), cmp_double);
+	printf("connect: %.1f us\n", t_conn);
+	printf("round trip (us, %lu requests): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+			count, lat[0], lat[count / 2], lat[count * 9 / 10],
+			lat[count * 99 / 100], lat[count - 1]);
+	printf("pipelined (depth %d): %.0f requests/s, %.2f us/request\n",
+			BENCH_DEPTH, count / (t_pipe / 1e6), t_pipe / count);
+	if (errs)
+		printf("%lu error responses\n", errs);
+
+	free(batch);
+	free(lat);
+	close(fd);
+	return errs ? 1 : 0;
+
+e_conn:
+	fprintf(stderr, "E: connection failed during benchmark\n");
+	free(batch);
+	free(lat);
+	close(fd);
+	return 2;
+}
+
+/* send @req and read its response, which must be "ok[ ...]" */
+static int
+conn_request(struct conn *c, const char *req, char *line, size_t sz)
+{
+	int r = write_all(c->fd, req, strlen(req));
+	if (r < 0)
+		return r;
+
+	/* skip events, this may be a subscriber */
+	do {
+		r = conn_read_line(c, line, sz);
+		if (r < 0)
+			return r;
+	} while (strstarts(line, "ev "));
+
+	if (!streq(line, "ok") && !strstarts(line, "ok ")) {
+		fprintf(stderr, "E: '%s' got '%s'\n", req, line);
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+/* does @line announce that backlight @name is at @permille? */
+static bool
+ev_is(const char *line, const char *name, long permille)
+{
+	size_t n = strlen(name);
+	return strstarts(line, "ev ") && !strncmp(line + 3, name, n)
+		&& line[3 + n] == ' ' && strtol(line + 4 + n, NULL, 10) == permille;
+}
+
+#define FANOUT_ROUNDS 100
+
+/*
+ * Subscribe @nsubs clients (without rate limiting), then set the first
+ * backlight back and forth FANOUT_ROUNDS times, timing how long each change
+ * takes to reach every subscriber. Ends at the brightness it started at.
+ */
+static int
+cmd_fanout(const char *path, unsigned long nsubs)
+{
+	char line[ILLUM_CTL_LINE_MAX], name[ILLUM_CTL_LINE_MAX];
+	char req[ILLUM_CTL_LINE_MAX * 2];
+	double lat[FANOUT_ROUNDS];
+	unsigned long i, events = 0;
+	int ret = 2;
+
+	/* one fd per subscriber, plus a few */
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < nsubs + 16) {
+		rl.rlim_cur = rl.rlim_max < nsubs + 16 ? rl.rlim_max : nsubs + 16;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	struct conn *ctl = calloc(1, sizeof(*ctl));
+	struct conn *subs = calloc(nsubs, sizeof(*subs));
+	struct pollfd *pfd = calloc(nsubs, sizeof(*pfd));
+	bool *seen = calloc(nsubs, sizeof(*seen));
+	if (ctl)
+		ctl->fd = -1;
+	for (i = 0; subs && i < nsubs; i++)
+		subs[i].fd = -1;
+	if (!ctl || !subs || !pfd || !seen) {
+		fprintf(stderr, "E: out of memory\n");
+		goto out;
+	}
+
+	ctl->fd = ctl_connect(path);
+	if (ctl->fd < 0)
+		goto out;
+
+	if (conn_request(ctl, "list\n", line, sizeof(line)) < 0)
+		goto out;
+	if (sscanf(line, "ok %255s", name) != 1) {
+		fprintf(stderr, "E: no backlights\n");
+		goto out;
+	}
+
+	snprintf(req, sizeof(req), "get %s\n", name);
+	if (conn_request(ctl, req, line, sizeof(line)) < 0)
+		goto out;
+	long cur = strtol(line + 2, NULL, 10);
+	long other = cur >= ILLUM_CTL_PERMILLE / 2 ? cur - 100 : cur + 100;
+
+	for (i = 0; i < nsubs; i++) {
+		subs[i].fd = ctl_connect(path);
+		if (subs[i].fd < 0)
+			goto out;
+		if (conn_request(&subs[i], "sub 0\n", line, sizeof(line)) < 0)
+			goto out;
+	}
+
+	/* the initial events */
+	for (i = 0; i < nsubs; i++) {
+		do {
+			if (conn_read_line(&subs[i], line, sizeof(line)) < 0)
+				goto e_conn;
+		} while (!ev_is(line, name, cur));
+	}
+
+	double total = now_us();
+	unsigned round;
+	for (round = 0; round < FANOUT_ROUNDS; round++) {
+		long v = round % 2 ? cur : other;
+		unsigned long left = nsubs;
+
+		memset(seen, 0, nsubs * sizeof(*seen));
+		snprintf(req, sizeof(req), "set %s %ld\n", name, v);
+
+		double t0 = now_us();
+		if (conn_request(ctl, req, line, sizeof(line)) < 0)
+			goto out;
+
+		while (left) {
+			unsigned long n = 0;
+			for (i = 0; i < nsubs; i++) {
+				if (seen[i])
+					continue;
+				pfd[n].fd = subs[i].fd;
+				pfd[n].events = POLLIN;
+				n++;
+			}
+
+			if (poll(pfd, n, -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				goto e_conn;
+			}
+
+			/* pfd is in the same order as the unseen subs */
+			unsigned long j = 0;
+			for (i = 0; i < nsubs; i++) {
+				if (seen[i])
+					continue;
+				if (!pfd[j++].revents)
+					continue;
+				if (conn_fill(&subs[i]) < 0)
+					goto e_conn;
+				while (!conn_next_line(&subs[i], line, sizeof(line))) {
+					events++;
+					if (ev_is(line, name, v)) {
+						seen[i] = true;
+						left--;
+					}
+				}
+			}
+		}
+
+		lat[round] = now_us() - t0;
+	}
+	total = now_us() - total;
+
+	qsort(lat, FANOUT_ROUNDS, sizeof(*lat), cmp_double);
+	printf("%lu subscribers, %d changes of %s\n", nsubs, FANOUT_ROUNDS, name);
+	printf("change to last subscriber (us): min %.1f  p50 %.1f  p90 %.1f  max %.1f\n",
+			lat[0], lat[FANOUT_ROUNDS / 2], lat[FANOUT_ROUNDS * 9 / 10],
+			lat[FANOUT_ROUNDS - 1]);
+	printf("%lu events delivered, %.0f events/s\n", events, events / (total / 1e6));
+	ret = 0;
+	goto out;
+
+e_conn:
+	fprintf(stderr, "E: subscriber connection failed\n");
+out:
+	if (subs) {
+		for (i = 0; i < nsubs; i++)
+			if (subs[i].fd >= 0)
+				close(subs[i].fd);
+	}
+	if (ctl && ctl->fd >= 0)
+		close(ctl->fd);
+	free(seen);
+	free(pfd);
+	free(subs);
+	free(ctl);
+	return ret;
+}
+
+/*
+ * Hold an inhibit for as long as @cmd (and anything it leaves the fd open
+ * in) runs, or with no @cmd until we're killed.
+ */
+static int
+cmd_inhibit(const char *path, const char *what, char **cmd)
+{
+	char line[16];
+	int fd = ctl_connect(path);
+	if (fd < 0)
+		return 2;
+
+	int len = snprintf(line, sizeof(line), "%s\n", what);
+	int r = write_all(fd, line, len);
+	if (r < 0) {
+		fprintf(stderr, "E: write: %s\n", strerror(-r));
+		return 2;
+	}
+
+	if (!cmd[0]) {
+		for (;;)
+			pause();
+	}
+
+	/* the inhibit is passed on through exec */
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC);
+	execvp(cmd[0], cmd);
+	fprintf(stderr, "E: could not run %s: %s\n", cmd[0], strerror(errno));
+	return 127;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	const char *inhibit = NULL;
+	bool batch = false;
+	unsigned long bench = 0, fanout = 0;
+	int c, e = 0;
+
+	while ((c = getopt(argc, argv, opts)) != -1) {
+		switch (c) {
+		case 'h':
+			usage();
+			return 0;
+		case 'V':
+			puts("illum-" stringify(CFG_GIT_VERSION));
+			return 0;
+		case 's':
+			path = optarg;
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'i':
+			if (!streq(optarg, "dim") && !streq(optarg, "all")) {
+				fprintf(stderr, "E: -i must be 'dim' or 'all', got '%s'\n",
+						optarg);
+				e++;
+			}
+			inhibit = optarg;
+			break;
+		case 'L':
+		case 'F': {
+			char *end;
+			errno = 0;
+			unsigned long x = strtoul(optarg, &end, 0);
+			if (errno || end == optarg || *end || !x || *optarg == '-') {
+				fprintf(stderr, "E: -%c must be a positive integer, got '%s'\n",
+						c, optarg);
+				e++;
+			}
+			if (c == 'L')
+				bench = x;
+			else
+				fanout = x;
+			break;
+		}
+		case '?':
+		default:
+			e++;
+		}
+	}
+
+	int nargs = argc - optind;
+	if (!e && (batch ? nargs > 0 : !nargs && !bench && !fanout && !inhibit)) {
+		fprintf(stderr, "E: %s\n", batch ? "-b takes requests from stdin only"
+				: "no request given");
+		e++;
+	}
+
+	if (e) {
+		usage();
+		return 2;
+	}
+
+	if (!path) {
+		path = getenv(inhibit ? "ILLUM_INHIBIT_SOCKET" : "ILLUM_CTL_SOCKET");
+		if (!path || !*path)
+			path = inhibit ? ILLUM_INHIBIT_PATH : ILLUM_CTL_PATH;
+	}
+
+	if (inhibit)
+		return cmd_inhibit(path, inhibit, argv + optind);
+
+	if (fanout)
+		return cmd_fanout(path, fanout);
+
+	if (bench) {
+		char req[ILLUM_CTL_LINE_MAX] = "get\n";
+		int len = 4;
+		if (nargs)
+			len = request_join(req, sizeof(req), nargs, argv + optind);
+		if (len < 0) {
+			fprintf(stderr, "E: request too long\n");
+			return 2;
+		}
+		return cmd_bench(path, bench, req, len);
+	}
+
+	int fd = ctl_connect(path);
+	if (fd < 0)
+		return 2;
+
+	if (batch)
+		return cmd_batch(fd);
+
+	char req[ILLUM_CTL_LINE_MAX];
+	int len = request_join(req, sizeof(req), nargs, argv + optind);
+	if (len < 0) {
+		fprintf(stderr, "E: request too long\n");
+		return 2;
+	}
+
+	return cmd_one(fd, req, len);
+}
@@ -0,0 +1,92 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#include "state.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct state_file *state_open(const char *dir)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/" ILLUM_STATE_FILE, dir);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st))
+		goto err;
+
+	/* a file we don't recognize is started over rather than trusted */
+	bool fresh = (size_t)st.st_size != sizeof(struct state_file);
+	if (fresh && ftruncate(fd, 0))
+		goto err;
+	if (fresh && ftruncate(fd, sizeof(struct state_file)))
+		goto err;
+
+	struct state_file *sf = mmap(NULL, sizeof(*sf), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (sf == MAP_FAILED)
+		goto err;
+	close(fd);
+
+	if (memcmp(sf->magic, STATE_MAGIC, sizeof(sf->magic)) ||
+			sf->version != STATE_VERSION ||
+			sf->slot_ct != STATE_SLOTS) {
+		memset(sf, 0, sizeof(*sf));
+		memcpy(sf->magic, STATE_MAGIC, sizeof(sf->magic));
+		sf->version = STATE_VERSION;
+		sf->slot_ct = STATE_SLOTS;
+	}
+
+	return sf;
+
+err:;
+	int e = errno;
+	close(fd);
+	errno = e;
+	return NULL;
+}
+
+/*
+ * Ids are stored cut to fit, keeping their end (a backlight's name and the
+ * devices nearest to it tell it apart, the bus they all hang off doesn't),
+ * and looked up cut the same way.
+ */
+static const char *
+state_id_key(const char *id)
+{
+	size_t len = strlen(id);
+	return len < STATE_ID_LEN ? id : id + len - (STATE_ID_LEN - 1);
+}
+
+struct state_slot *state_slot(struct state_file *sf, const char *id)
+{
+	struct state_slot *free_slot = NULL;
+	const char *key = state_id_key(id);
+	size_t i;
+	for (i = 0; i < STATE_SLOTS; i++) {
+		struct state_slot *ss = &sf->slots[i];
+		if (!ss->id[0]) {
+			if (!free_slot)
+				free_slot = ss;
+		} else if (!strncmp(ss->id, key, sizeof(ss->id))) {
+			return ss;
+		}
+	}
+
+	if (free_slot) {
+		memset(free_slot->id, 0, sizeof(free_slot->id));
+		memcpy(free_slot->id, key, strlen(key));
+		free_slot->pos = 0;
+		free_slot->flags = 0;
+	}
+	return free_slot;
+}
@@ -0,0 +1,64 @@
+#ifndef ILLUM_STATE_H_
+#define ILLUM_STATE_H_
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Persisted brightness, so backlights come back where they were left.
+ *
+ * The state file is a single page with a fixed layout, mapped shared for
+ * the life of the daemon: saving a value is a store into the mapping and
+ * the kernel writes the page back with the rest of the dirty data (no
+ * write() or fsync() per keypress). A crash loses at most the last few
+ * seconds of changes, which is fine for a brightness level.
+ *
+ * Slots are keyed by a stable identity of the backlight (see
+ * sys_backlight_state_id()) and never freed, there are far more of them than
+ * backlights on any one machine.
+ */
+#define ILLUM_STATE_DIR "/var/lib/illum"
+#define ILLUM_STATE_FILE "state"
+
+#define STATE_MAGIC "illum-st"
+#define STATE_VERSION 1
+#define STATE_ID_LEN 120
+#define STATE_SLOTS 31
+
+#define STATE_SLOT_SET 0x1
+
+struct state_slot {
+	char id[STATE_ID_LEN];
+	/* a curve position, see curve.h */
+	uint32_t pos;
+	uint32_t flags;
+};
+
+struct state_file {
+	char magic[8];
+	uint32_t version;
+	uint32_t slot_ct;
+	struct state_slot slots[STATE_SLOTS];
+};
+
+/*
+ * Map (creating or resetting it if needed) the state file in @dir.
+ * Returns the mapping, or NULL with errno set.
+ */
+struct state_file *state_open(const char *dir);
+
+/*
+ * The slot for @id, taking a free one if there is none yet. NULL if the
+ * file is full. Ids of STATE_ID_LEN or more chars are told apart by their
+ * last STATE_ID_LEN - 1.
+ */
+struct state_slot *state_slot(struct state_file *sf, const char *id);
+
+static inline void
+state_slot_save(struct state_slot *ss, uint32_t pos)
+{
+	ss->pos = pos;
+	ss->flags |= STATE_SLOT_SET;
+}
+
+#endif
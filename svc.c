@@ -0,0 +1,102 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#include "svc.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* ccan */
+#include <ccan/str/str.h>
+
+#define SVC_LISTEN_FDS_START 3
+
+/* LISTEN_FDS, if they were meant for us */
+static int
+svc_listen_count(void)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	char *end;
+
+	if (!pid || !fds)
+		return 0;
+
+	errno = 0;
+	unsigned long p = strtoul(pid, &end, 10);
+	if (errno || *end || p != (unsigned long)getpid())
+		return 0;
+
+	long n = strtol(fds, &end, 10);
+	if (errno || *end || n < 0 || n > 64)
+		return 0;
+
+	return n;
+}
+
+int svc_listen_fd(const char *name, const char *dflt)
+{
+	int n = svc_listen_count();
+	const char *names = getenv("LISTEN_FDNAMES");
+	int i, fd = -1;
+
+	if (!names) {
+		if (n == 1 && streq(name, dflt))
+			fd = SVC_LISTEN_FDS_START;
+	} else {
+		size_t len = strlen(name);
+		const char *p = names;
+		for (i = 0; i < n; i++) {
+			size_t l = strcspn(p, ":");
+			if (l == len && !memcmp(p, name, len)) {
+				fd = SVC_LISTEN_FDS_START + i;
+				break;
+			}
+			if (!p[l])
+				break;
+			p += l + 1;
+		}
+	}
+
+	if (fd == -1)
+		return -1;
+
+	/* they come without either */
+	int fl = fcntl(fd, F_GETFL);
+	if (fl == -1 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1 ||
+			fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		return -1;
+
+	return fd;
+}
+
+int svc_notify(const char *state)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (!path || (*path != '/' && *path != '@'))
+		return 0;
+
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	size_t len = strlen(path);
+	if (len >= sizeof(sa.sun_path))
+		return -ENAMETOOLONG;
+	memcpy(sa.sun_path, path, len);
+	if (*path == '@')
+		sa.sun_path[0] = '\0';
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -errno;
+
+	ssize_t r = sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+			(struct sockaddr *)&sa,
+			offsetof(struct sockaddr_un, sun_path) + len);
+	int e = errno;
+	close(fd);
+	return r == -1 ? -e : 1;
+}
@@ -0,0 +1,31 @@
+#ifndef ILLUM_SVC_H_
+#define ILLUM_SVC_H_
+#pragma once
+
+/*
+ * The two service manager protocols illum-d speaks, without libsystemd:
+ *
+ *  - socket activation: listening sockets handed over as fds 3 and up, with
+ *    LISTEN_PID, LISTEN_FDS and (optionally) LISTEN_FDNAMES describing them
+ *  - readiness: "READY=1" and friends sent as a datagram to the unix socket
+ *    named by NOTIFY_SOCKET ('@' for the abstract namespace)
+ *
+ * Both are no-ops when the variables aren't set, so running illum-d by hand
+ * or under another init is unaffected.
+ */
+
+/*
+ * The passed fd named @name (FileDescriptorName= in the socket unit), made
+ * non-blocking. A single unnamed fd is taken to be @dflt's. Returns -1 if
+ * there is none.
+ */
+int svc_listen_fd(const char *name, const char *dflt);
+
+/*
+ * Send @state (newline separated assignments, like "READY=1") to the
+ * service manager. Returns 0 if there is none to send to, 1 if sent, or
+ * negative errno.
+ */
+int svc_notify(const char *state);
+
+#endif
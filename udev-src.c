@@ -0,0 +1,271 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+/*
+ * The udev device source: the initial scan and hotplug through the udev
+ * netlink monitor, translated into struct illum_dev for illum.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libudev.h>
+
+#include "illum.h"
+
+/* ccan */
+#include <ccan/pr_log/pr_log.h>
+#include <ccan/str/str.h>
+#include <ccan/container_of/container_of.h>
+
+struct udev_src {
+	struct illum *illum;
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	ev_io w;
+};
+
+static signed char
+udev_src_prop(struct udev_device *dev, const char *key)
+{
+	const char *v = udev_device_get_property_value(dev, key);
+	return v ? streq(v, "1") : -1;
+}
+
+/*
+ * Everything used here comes from the uevent/udev database udev already
+ * read, none of it costs a sysfs access.
+ */
+static int
+udev_src_dev(struct udev_device *dev, struct illum_dev *d)
+{
+	const char *subsystem = udev_device_get_subsystem(dev);
+
+	if (!subsystem)
+		return -1;
+	else if (streq(subsystem, "backlight"))
+		d->kind = ILLUM_DEV_BACKLIGHT;
+	else if (streq(subsystem, "input"))
+		d->kind = ILLUM_DEV_INPUT;
+	else
+		return -1;
+
+	d->syspath = udev_device_get_syspath(dev);
+	d->devnode = udev_device_get_devnode(dev);
+	d->devnum = udev_device_get_devnum(dev);
+	d->id_input = udev_src_prop(dev, "ID_INPUT");
+	d->id_key = udev_src_prop(dev, "ID_INPUT_KEY");
+	return 0;
+}
+
+static void
+udev_src_cb(EV_P_ ev_io *w, int revents)
+{
+	(void)revents;
+
+	struct udev_src *us = container_of(w, struct udev_src, w);
+	wake_note(EV_A_ WAKE_UDEV);
+
+	for (;;) {
+		struct udev_device *dev = udev_monitor_receive_device(us->monitor);
+		if (!dev)
+			break;
+
+		const char *action = udev_device_get_action(dev);
+		const char *subsystem = udev_device_get_subsystem(dev);
+		const char *sys_path = udev_device_get_syspath(dev);
+		struct illum_dev d;
+
+		pr_debug("op: %s : %s\n", action, subsystem);
+
+		if (udev_src_dev(dev, &d)) {
+			pr_warn("unrecognized subsystem: %s\n", subsystem);
+			goto next_dev;
+		}
+
+		if (streq(action, "add")) {
+			d.action = ILLUM_DEV_ADD;
+		} else if (streq(action, "remove")) {
+			d.action = ILLUM_DEV_REMOVE;
+		} else if (streq(action, "change")) {
+			d.action = ILLUM_DEV_CHANGE;
+		} else {
+			pr_info("udev: unhandled action: %s on device %s\n", action, sys_path);
+			goto next_dev;
+		}
+
+		illum_dev_event(us->illum, &d EV_A__);
+
+next_dev:
+		udev_device_unref(dev);
+	}
+}
+
+static int
+udev_src_scan(struct udev_src *us, struct udev_enumerate *e EV_P__)
+{
+	int r = udev_enumerate_scan_devices(e);
+	if (r < 0)
+		return r;
+
+	struct udev_list_entry *list, *le;
+	list = udev_enumerate_get_list_entry(e);
+
+	udev_list_entry_foreach(le, list) {
+		const char *sys_path = udev_list_entry_get_name(le);
+		struct udev_device *dev = udev_device_new_from_syspath(us->udev, sys_path);
+		struct illum_dev d;
+
+		if (!dev)
+			continue;
+
+		pr_debug("%s devpath=%s devtype=%s\n", sys_path,
+				udev_device_get_devpath(dev),
+				udev_device_get_devtype(dev));
+
+		if (!udev_src_dev(dev, &d)) {
+			d.action = ILLUM_DEV_ADD;
+			illum_dev_found(us->illum, &d EV_A__);
+		}
+		udev_device_unref(dev);
+	}
+
+	return 0;
+}
+
+static void
+udev_src_rescan(void *src EV_P__)
+{
+	struct udev_src *us = src;
+	struct udev_enumerate *e = udev_enumerate_new(us->udev);
+	if (!e) {
+		pr_warn("udev: rescan: udev_enumerate_new() failed\n");
+		return;
+	}
+
+	int r = udev_enumerate_add_match_subsystem(e, "input");
+	if (r >= 0)
+		r = udev_enumerate_add_match_sysname(e, "event*");
+	if (r >= 0)
+		r = udev_src_scan(us, e EV_A__);
+	if (r < 0)
+		pr_warn("udev: rescan failed: %d\n", r);
+
+	udev_enumerate_unref(e);
+}
+
+int illum_udev_start(struct illum *illum EV_P__)
+{
+	struct udev_enumerate *bl_enum = NULL, *input_enum = NULL;
+	int r, ret;
+
+	struct udev_src *us = malloc(sizeof(*us));
+	if (!us) {
+		pr_error("out of memory\n");
+		return -3;
+	}
+	us->illum = illum;
+	us->monitor = NULL;
+
+	us->udev = udev_new();
+	if (!us->udev) {
+		pr_error("udev_new() failed\n");
+		ret = -3;
+		goto e_free;
+	}
+
+	bl_enum = udev_enumerate_new(us->udev);
+	if (!bl_enum) {
+		pr_error("udev_enumerate_new() failed\n");
+		ret = -4;
+		goto e_unref;
+	}
+
+	r = udev_enumerate_add_match_subsystem(bl_enum, "backlight");
+	if (r < 0) {
+		pr_error("udev_enumerate_add_match_subsystem failed: %d\n", r);
+		ret = -5;
+		goto e_unref;
+	}
+
+	input_enum = udev_enumerate_new(us->udev);
+	if (!input_enum) {
+		pr_error("udev enum new failed\n");
+		ret = -5;
+		goto e_unref;
+	}
+
+	r = udev_enumerate_add_match_subsystem(input_enum, "input");
+	if (r < 0) {
+		pr_error("udev_enumerate_add_match_subsystem failed: %d\n", r);
+		ret = -5;
+		goto e_unref;
+	}
+
+	r = udev_enumerate_add_match_sysname(input_enum, "event*");
+	if (r < 0) {
+		pr_error("udev_enumerate_add_match_sysname failed: %d\n", r);
+		ret = -5;
+		goto e_unref;
+	}
+
+	us->monitor = udev_monitor_new_from_netlink(us->udev, "udev");
+	if (!us->monitor) {
+		pr_error("udev_monitor_new_from_netlink() failed\n");
+		ret = -6;
+		goto e_unref;
+	}
+
+	r = udev_monitor_filter_add_match_subsystem_devtype(us->monitor, "backlight", NULL);
+	if (r < 0) {
+		pr_error("udev_monitor_filter_add_match_subsystem_devtype backlight failed: %d\n", r);
+		ret = -7;
+		goto e_unref;
+	}
+
+	r = udev_monitor_filter_add_match_subsystem_devtype(us->monitor, "input", NULL);
+	if (r < 0) {
+		pr_error("udev_monitor_filter_add_match_subsystem_devtype input failed: %d\n", r);
+		ret = -7;
+		goto e_unref;
+	}
+
+	r = udev_monitor_enable_receiving(us->monitor);
+	if (r < 0) {
+		pr_error("udev_monitor_enable_receiving failed: %d\n", r);
+		ret = -8;
+		goto e_unref;
+	}
+
+	r = udev_src_scan(us, bl_enum EV_A__);
+	if (r < 0) {
+		pr_error("backlight initial scan failed: %d\n", r);
+		ret = -9;
+		goto e_unref;
+	}
+
+	r = udev_src_scan(us, input_enum EV_A__);
+	if (r < 0) {
+		pr_error("input initial scan failed: %d\n", r);
+		ret = -9;
+		goto e_unref;
+	}
+
+	udev_enumerate_unref(bl_enum);
+	udev_enumerate_unref(input_enum);
+
+	ev_io_init(&us->w, udev_src_cb, udev_monitor_get_fd(us->monitor), EV_READ);
+	ev_io_start(EV_A_ &us->w);
+
+	illum->rescan = udev_src_rescan;
+	illum->rescan_src = us;
+	return 0;
+
+	/* the unref()s all take NULL */
+e_unref:
+	udev_monitor_unref(us->monitor);
+	udev_enumerate_unref(input_enum);
+	udev_enumerate_unref(bl_enum);
+	udev_unref(us->udev);
+e_free:
+	free(us);
+	return ret;
+}
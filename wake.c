@@ -0,0 +1,87 @@
+/* ex: set noet sw=8 sts=8 ts=8 tw=78: */
+#include "wake.h"
+
+#include <time.h>
+
+const char *const wake_src_names[WAKE_SRC_CT] = {
+	[WAKE_OTHER] = "other",
+	[WAKE_INPUT] = "input",
+	[WAKE_UDEV] = "udev",
+	[WAKE_ALS] = "als",
+	[WAKE_CONF] = "conf",
+	[WAKE_CTL] = "ctl",
+	[WAKE_INHIBIT] = "inhibit",
+	[WAKE_SIGNAL] = "signal",
+	[WAKE_FADE] = "fade",
+	[WAKE_HOLD] = "hold",
+	[WAKE_IDLE] = "idle",
+	[WAKE_SUB] = "sub",
+	[WAKE_PROBE] = "probe",
+	[WAKE_FLUSH] = "flush",
+};
+
+/* CPU time of the loop's thread, in ns */
+static uint64_t
+wake_cpu_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void wake__switch(struct wake_acct *wa, enum wake_src src)
+{
+	/* a run of one source's callbacks needs no clock reads in between */
+	if (src != wa->cur) {
+		uint64_t now = wake_cpu_now();
+		wa->src[wa->cur].cpu_ns += now - wa->mark;
+		wa->mark = now;
+		wa->cur = src;
+	}
+
+	wa->src[src].calls++;
+	if (wa->first) {
+		wa->src[src].wakeups++;
+		wa->first = false;
+	}
+}
+
+/*
+ * libev invokes pending watchers once after each wait, and (with prepare
+ * watchers active) once more before the next. Only the first is a wakeup,
+ * and the loop's iteration count tells them apart: it goes up right before
+ * each wait.
+ */
+static void
+wake_invoke(EV_P)
+{
+	struct wake_acct *wa = ev_userdata(EV_A);
+	unsigned it = ev_iteration(EV_A);
+
+	wa->first = it != wa->iteration;
+	if (wa->first) {
+		wa->iteration = it;
+		wa->wakeups++;
+	}
+
+	uint64_t start = wake_cpu_now();
+	wa->cur = WAKE_OTHER;
+	wa->mark = start;
+
+	ev_invoke_pending(EV_A);
+
+	uint64_t now = wake_cpu_now();
+	wa->src[wa->cur].cpu_ns += now - wa->mark;
+	wa->cpu_ns += now - start;
+	if (wa->first) {
+		wa->src[WAKE_OTHER].wakeups++;
+		wa->first = false;
+	}
+}
+
+void wake_attach(struct wake_acct *wa EV_P__)
+{
+	wa->iteration = ev_iteration(EV_A);
+	ev_set_userdata(EV_A_ wa);
+	ev_set_invoke_pending_cb(EV_A_ wake_invoke);
+}
@@ -0,0 +1,89 @@
+#ifndef ILLUM_WAKE_H_
+#define ILLUM_WAKE_H_
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ev-ext.h"
+
+/*
+ * Wakeup accounting, so "illum-d sleeps while nothing happens" can be
+ * checked rather than hoped for (see illum-bench -w).
+ *
+ * A wakeup is the event loop coming back from waiting. They are counted by
+ * the loop's invoke_pending callback (wake_attach()), so every one is seen,
+ * whatever watcher caused it and whether or not that watcher knows about
+ * any of this: a timer added later without a wake_note() still shows up,
+ * as WAKE_OTHER.
+ *
+ * Callbacks mark themselves with wake_note(). The CPU time since the
+ * previous mark goes to whichever source was running, and the first source
+ * marked after a wait is the one the wakeup is charged to. It is the loop
+ * thread's CPU time (CLOCK_THREAD_CPUTIME_ID), so a callback that blocks or
+ * is preempted isn't billed for the wait. That clock is a syscall rather
+ * than vDSO, so it is only read when the source changes: twice per wakeup
+ * plus once per switch.
+ */
+enum wake_src {
+	/* callbacks without a wake_note(), and the loop's own work */
+	WAKE_OTHER,
+	WAKE_INPUT,
+	WAKE_UDEV,
+	WAKE_ALS,
+	WAKE_CONF,
+	WAKE_CTL,
+	WAKE_INHIBIT,
+	WAKE_SIGNAL,
+	/* timers */
+	WAKE_FADE,
+	WAKE_HOLD,
+	WAKE_IDLE,
+	WAKE_SUB,
+	/* work the loop defers to itself (ev_idle, ev_prepare) */
+	WAKE_PROBE,
+	WAKE_FLUSH,
+	WAKE_SRC_CT
+};
+
+struct wake_stat {
+	/* wakeups it was the first to run in */
+	uintmax_t wakeups;
+	/* callbacks run, including ones in wakeups charged to others */
+	uintmax_t calls;
+	/* CPU time in its callbacks */
+	uint64_t cpu_ns;
+};
+
+struct wake_acct {
+	uintmax_t wakeups;
+	uint64_t cpu_ns;
+	struct wake_stat src[WAKE_SRC_CT];
+
+	/* for wake_invoke() and wake_note() */
+	unsigned iteration;
+	bool first;
+	enum wake_src cur;
+	uint64_t mark;
+};
+
+extern const char *const wake_src_names[WAKE_SRC_CT];
+
+/*
+ * Account @loop's wakeups in @wa. Takes the loop's invoke_pending callback
+ * and userdata.
+ */
+void wake_attach(struct wake_acct *wa EV_P__);
+
+void wake__switch(struct wake_acct *wa, enum wake_src src);
+
+/* the callback running now is @src's */
+static inline void
+wake_note(EV_P_ enum wake_src src)
+{
+	struct wake_acct *wa = ev_userdata(EV_A);
+	if (wa)
+		wake__switch(wa, src);
+}
+
+#endif